@@ -1,5 +1,12 @@
 echo procname = firefox
 
+# rewritten every few seconds, and only used to restore a crashed session
+echo "policy = every:4 /sessionstore-backups/recovery.jsonlz4"
+
+# regenerated by the browser when missing, not worth RAM or resyncs
+echo "exclude = startupCache"
+echo "exclude = shader-cache"
+
 # https://github.com/graysky2/profile-sync-daemon/blob/master/common/browsers/firefox
 while read -r profileItem; do
     if [[ $(echo "$profileItem" | cut -c1) = "/" ]]; then
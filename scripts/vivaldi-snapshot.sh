@@ -1,4 +1,17 @@
 echo procname = vivaldi-bin
 
+# rewritten as tabs change, unsyncing always brings them up to date
+echo "policy = every:4 /*/Sessions/*"
+# the layout before Sessions/
+echo "policy = every:4 /*/Current Session"
+echo "policy = every:4 /*/Current Tabs"
+
+# regenerated by the browser when missing, not worth RAM or resyncs
+echo "exclude = Code Cache"
+echo "exclude = GPUCache"
+echo "exclude = GrShaderCache"
+echo "exclude = ShaderCache"
+echo "exclude = Dawn*Cache"
+
 echo profile = "$XDG_CONFIG_HOME/vivaldi-snapshot"
 echo cache = "$XDG_CACHE_HOME/vivaldi-snapshot"
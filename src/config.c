@@ -1,45 +1,99 @@
 #define _GNU_SOURCE
 #include "config.h"
 #include "log.h"
+#include "policy.h"
 #include "util.h"
 #include "ini.h"
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <unistd.h>
 
+// appended to .bor.conf
+#define DOTBORCONF_FOOTER "# DO NOT EDIT THIS FILE!"
+
 // OPT_END -> signify end of opt array
-enum OptType { OPT_END, OPT_BOOL, OPT_INT };
+// OPT_ENUM -> int set to index of value in values
+// OPT_SIZE -> long long set to a size in bytes, which can end with K, M or G
+enum OptType { OPT_END, OPT_BOOL, OPT_INT, OPT_ENUM, OPT_SIZE };
 struct Opt {
         char *name;
         void *data;
         enum OptType type;
+        const char *const *values;
 };
 
+#ifndef NOOVERLAY
+static const char *const overlay_lower_values[] = { "disk", "erofs",
+                                                    "squashfs", NULL };
+#endif
+static const char *const exclude_mode_values[] = { "disk", "ram", NULL };
+static const char *const cache_mode_values[] = { "copy", "ephemeral",
+                                                  "discard", NULL };
+
 static int set_environment(void);
 static int parse_config(const char *config_file);
 static int parse_config_handler(void *user, const char *section,
                                 const char *name, const char *value);
 static int section_config_handler(const char *name, const char *value);
 static int section_browsers_handler(const char *name);
+static int load_browsers(void);
+static bool browser_needed(const char *name);
+static bool is_selected_browser(const char *name);
+static void select_dirs(struct Browser *browser);
 static struct Browser *run_browser_sh(const char *browsername);
 static int parse_browser_sh(const char *path, struct Browser *browser);
 static int parse_browser_sh_handler(void *user, const char *UNUSED(section),
                                     const char *name, const char *value);
+static char *read_options(const char *config_file, bool significant);
 
 struct ConfigSkel CONFIG = { 0 };
 struct PathsSkel PATHS = { 0 };
 
+// browsers in the [browsers] section, their scripts are run after parsing
+static char browser_names[MAX_BROWSERS][BROWSER_NAME_SIZE];
+static size_t browser_names_num = 0;
+
+// policies in the [config] section, for every browser
+static struct Policy *config_policies = NULL;
+static size_t config_policies_num = 0;
+
+// given with --browser and --dir
+static char selected_browsers[MAX_BROWSERS][BROWSER_NAME_SIZE];
+static size_t selected_browsers_num = 0;
+static char selected_dirs[MAX_DIRS][PATH_MAX];
+static size_t selected_dirs_num = 0;
+
 static struct Opt OPTS[] = {
 #ifndef NOOVERLAY
-        { "enable_overlay", &CONFIG.enable_overlay, OPT_BOOL },
+        { "enable_overlay", &CONFIG.enable_overlay, OPT_BOOL, NULL },
+        { "rootless_overlay", &CONFIG.rootless_overlay, OPT_BOOL, NULL },
+        { "compact_overlay", &CONFIG.compact_overlay, OPT_BOOL, NULL },
+        { "overlay_metacopy", &CONFIG.overlay_metacopy, OPT_BOOL, NULL },
+        { "overlay_volatile", &CONFIG.overlay_volatile, OPT_BOOL, NULL },
+        { "overlay_lower", &CONFIG.overlay_lower, OPT_ENUM,
+          overlay_lower_values },
+        { "lazy_sync", &CONFIG.lazy_sync, OPT_BOOL, NULL },
 #endif
-        { "enable_cache", &CONFIG.enable_cache, OPT_BOOL },
-        { "resync_cache", &CONFIG.resync_cache, OPT_BOOL },
-        { "reset_overlay", &CONFIG.reset_overlay, OPT_BOOL },
-        { "max_log_entries", &CONFIG.max_log_entries, OPT_INT },
-        { NULL, NULL, OPT_END }
+        { "enable_cache", &CONFIG.enable_cache, OPT_BOOL, NULL },
+        { "resync_cache", &CONFIG.resync_cache, OPT_BOOL, NULL },
+        { "cache_mode", &CONFIG.cache_mode, OPT_ENUM, cache_mode_values },
+        { "durable_resync", &CONFIG.durable_resync, OPT_BOOL, NULL },
+        { "reset_overlay", &CONFIG.reset_overlay, OPT_BOOL, NULL },
+        { "snapshot_backups", &CONFIG.snapshot_backups, OPT_BOOL, NULL },
+        { "generations_hourly", &CONFIG.generations_hourly, OPT_INT, NULL },
+        { "generations_daily", &CONFIG.generations_daily, OPT_INT, NULL },
+        { "max_log_entries", &CONFIG.max_log_entries, OPT_INT, NULL },
+        { "coalesce_resyncs", &CONFIG.coalesce_resyncs, OPT_INT, NULL },
+        { "resync_budget", &CONFIG.resync_budget, OPT_SIZE, NULL },
+        { "resync_max_age", &CONFIG.resync_max_age, OPT_INT, NULL },
+        { "resync_quiet", &CONFIG.resync_quiet, OPT_INT, NULL },
+        { "resync_bandwidth", &CONFIG.resync_bandwidth, OPT_SIZE, NULL },
+        { "resync_iops", &CONFIG.resync_iops, OPT_INT, NULL },
+        { "exclude_mode", &CONFIG.exclude_mode, OPT_ENUM, exclude_mode_values },
+        { NULL, NULL, OPT_END, NULL }
 };
 
 // initialize paths (does not create them)
@@ -53,15 +107,44 @@ int init_paths(void)
 
         snprintf(PATHS.runtime, PATH_MAX, "%s/bor", getenv("XDG_RUNTIME_DIR"));
         snprintf(PATHS.tmpfs, PATH_MAX, "%s/tmpfs", PATHS.runtime);
+        snprintf(PATHS.journals, PATH_MAX, "%s/journals", PATHS.runtime);
+        snprintf(PATHS.state, PATH_MAX, "%s/state", PATHS.runtime);
+        snprintf(PATHS.detached, PATH_MAX, "%s/detached", PATHS.runtime);
+        snprintf(PATHS.lock, PATH_MAX, "%s/lock", PATHS.runtime);
+        snprintf(PATHS.resynced, PATH_MAX, "%s/resynced", PATHS.runtime);
         snprintf(PATHS.config, PATH_MAX, "%s/bor", getenv("XDG_CONFIG_HOME"));
         snprintf(PATHS.backups, PATH_MAX, "%s/backups", PATHS.config);
+        snprintf(PATHS.snapshots, PATH_MAX, "%s/snapshots", PATHS.config);
+        snprintf(PATHS.generations, PATH_MAX, "%s/generations", PATHS.config);
         snprintf(PATHS.logs, PATH_MAX, "%s/logs", PATHS.config);
         snprintf(PATHS.share_dir, PATH_MAX, "/usr/share/bor/");
         snprintf(PATHS.share_dir_local, PATH_MAX, "/usr/local/share/bor");
 
 #ifndef NOOVERLAY
+        snprintf(PATHS.mountpoint, PATH_MAX, "%s", PATHS.tmpfs);
         snprintf(PATHS.overlay_upper, PATH_MAX, "%s/upper", PATHS.runtime);
         snprintf(PATHS.overlay_work, PATH_MAX, "%s/work", PATHS.runtime);
+        snprintf(PATHS.overlay_pid, PATH_MAX, "%s/overlay.pid", PATHS.runtime);
+        snprintf(PATHS.overlay_opts, PATH_MAX, "%s/overlay.opts",
+                 PATHS.runtime);
+        snprintf(PATHS.overlay_trash, PATH_MAX, "%s/trash", PATHS.runtime);
+        snprintf(PATHS.overlay_retired, PATH_MAX, "%s/retired",
+                 PATHS.runtime);
+        snprintf(PATHS.overlay_lower, PATH_MAX, "%s", PATHS.backups);
+        snprintf(PATHS.lower_image, PATH_MAX, "%s/lower.img", PATHS.runtime);
+        snprintf(PATHS.lower_mountpoint, PATH_MAX, "%s/lower", PATHS.runtime);
+        snprintf(PATHS.standby_mountpoint, PATH_MAX, "%s/tmpfs-standby",
+                 PATHS.runtime);
+        snprintf(PATHS.standby_tmpfs, PATH_MAX, "%s", PATHS.standby_mountpoint);
+        snprintf(PATHS.standby_upper, PATH_MAX, "%s/upper-standby",
+                 PATHS.runtime);
+        snprintf(PATHS.standby_work, PATH_MAX, "%s/work-standby",
+                 PATHS.runtime);
+        snprintf(PATHS.standby_lower_image, PATH_MAX, "%s/lower-standby.img",
+                 PATHS.runtime);
+        snprintf(PATHS.standby_lower_mountpoint, PATH_MAX, "%s/lower-standby",
+                 PATHS.runtime);
+        snprintf(PATHS.hydrate_pid, PATH_MAX, "%s/hydrate.pid", PATHS.runtime);
 #endif
 
         plog(LOG_DEBUG, "config dir: %s", PATHS.config);
@@ -113,11 +196,29 @@ int init_config(bool save_config)
         // defaults
 #ifndef NOOVERLAY
         CONFIG.enable_overlay = false;
+        CONFIG.rootless_overlay = false;
+        CONFIG.compact_overlay = false;
+        CONFIG.overlay_metacopy = false;
+        CONFIG.overlay_volatile = false;
+        CONFIG.overlay_lower = LOWER_DISK;
+        CONFIG.lazy_sync = false;
 #endif
         CONFIG.enable_cache = false;
         CONFIG.resync_cache = true;
+        CONFIG.cache_mode = CACHE_COPY;
+        CONFIG.durable_resync = false;
         CONFIG.reset_overlay = false;
+        CONFIG.snapshot_backups = false;
+        CONFIG.generations_hourly = 0;
+        CONFIG.generations_daily = 0;
         CONFIG.max_log_entries = 10;
+        CONFIG.coalesce_resyncs = 60;
+        CONFIG.resync_budget = 64LL * 1024 * 1024;
+        CONFIG.resync_max_age = 3600;
+        CONFIG.resync_quiet = 30;
+        CONFIG.resync_bandwidth = 50LL * 1024 * 1024;
+        CONFIG.resync_iops = 0;
+        CONFIG.exclude_mode = EXCLUDE_DISK;
 
         char borconf[PATH_MAX], dotborconf[PATH_MAX];
 
@@ -143,7 +244,7 @@ int init_config(bool save_config)
                         FILE *fp = fopen(dotborconf, "a");
 
                         if (fp != NULL) {
-                                fprintf(fp, "# DO NOT EDIT THIS FILE!\n");
+                                fprintf(fp, DOTBORCONF_FOOTER "\n");
                                 fclose(fp);
                         }
 
@@ -162,16 +263,153 @@ int init_config(bool save_config)
         return 0;
 }
 
+// parse bor.conf into config, without affecting the current session
+int load_new_config(struct ConfigSkel *config)
+{
+        struct ConfigSkel current = CONFIG;
+        char borconf[PATH_MAX];
+
+        snprintf(borconf, PATH_MAX, "%s/bor.conf", PATHS.config);
+
+        CONFIG.browsers_num = 0;
+
+        int err = parse_config(borconf);
+
+        *config = CONFIG;
+        CONFIG = current;
+
+        return err;
+}
+
+// true if anything other than browsers differs between bor.conf and the
+// .bor.conf of the current session
+bool config_options_changed(void)
+{
+        char borconf[PATH_MAX], dotborconf[PATH_MAX];
+
+        snprintf(borconf, PATH_MAX, "%s/bor.conf", PATHS.config);
+        snprintf(dotborconf, PATH_MAX, "%s/.bor.conf", PATHS.config);
+
+        char *options = read_options(borconf, true),
+             *saved = read_options(dotborconf, true);
+        bool changed = options == NULL || saved == NULL ||
+                       !STR_EQUAL(options, saved);
+
+        free(options);
+        free(saved);
+
+        return changed;
+}
+
+// replace the browsers in .bor.conf with the ones in CONFIG, everything else
+// is kept as it is
+int save_session_config(void)
+{
+        char dotborconf[PATH_MAX], tmp[PATH_MAX];
+
+        snprintf(dotborconf, PATH_MAX, "%s/.bor.conf", PATHS.config);
+        create_unique_path(tmp, PATH_MAX, dotborconf, 0);
+
+        char *options = read_options(dotborconf, false);
+
+        if (options == NULL) {
+                return -1;
+        }
+        FILE *fp = fopen(tmp, "w");
+
+        if (fp == NULL) {
+                free(options);
+                return -1;
+        }
+        fprintf(fp, "%s[browsers]\n", options);
+        free(options);
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                fprintf(fp, "%s\n", CONFIG.browsers[i]->name);
+        }
+        fprintf(fp, DOTBORCONF_FOOTER "\n");
+
+        // replaced atomically, so that a session always has a config
+        if (fclose(fp) == EOF || chmod(tmp, 0444) == -1 ||
+            rename(tmp, dotborconf) == -1) {
+                int prev_errno = errno;
+
+                unlink(tmp);
+                errno = prev_errno;
+
+                return -1;
+        }
+
+        return 0;
+}
+
+// lines of config_file outside of the [browsers] section, only those that
+// have an effect (trimmed) if significant
+static char *read_options(const char *config_file, bool significant)
+{
+        FILE *fp = fopen(config_file, "r");
+
+        if (fp == NULL) {
+                return NULL;
+        }
+        char *options = NULL, *line = NULL;
+        size_t options_size = 0, size = 0;
+        FILE *out = open_memstream(&options, &options_size);
+
+        if (out == NULL) {
+                fclose(fp);
+                return NULL;
+        }
+        bool in_browsers = false;
+
+        while (getline(&line, &size, fp) != -1) {
+                char *start = line + strspn(line, " \t");
+                size_t len = strcspn(start, "\r\n");
+
+                while (len > 0 && isspace(start[len - 1])) {
+                        len--;
+                }
+                start[len] = 0;
+
+                if (start[0] == '[') {
+                        in_browsers = STR_EQUAL(start, "[browsers]");
+                }
+                if (in_browsers || STR_EQUAL(start, DOTBORCONF_FOOTER)) {
+                        continue;
+                }
+                if (!significant) {
+                        fprintf(out, "%.*s%s\n", (int)(start - line), line,
+                                start);
+                } else if (len > 0 && start[0] != '#' && start[0] != ';') {
+                        fprintf(out, "%s\n", start);
+                }
+        }
+        free(line);
+        fclose(fp);
+
+        if (fclose(out) == EOF) {
+                free(options);
+                return NULL;
+        }
+
+        return options;
+}
+
 static int parse_config(const char *config_file)
 {
         plog(LOG_DEBUG, "parsing config file");
 
+        browser_names_num = 0;
+        free(config_policies);
+        config_policies = NULL;
+        config_policies_num = 0;
+
         if (ini_parse(config_file, parse_config_handler, NULL) != 0) {
                 plog(LOG_ERROR, "failed parsing config file");
                 return -1;
         }
 
-        return 0;
+        return load_browsers();
 }
 
 static int parse_config_handler(void *UNUSED(user), const char *section,
@@ -197,6 +435,18 @@ static int section_config_handler(const char *name, const char *value)
                 plog(LOG_ERROR, "key '%s' does not have a value", name);
                 return -1;
         }
+        // can be given more than once
+        if (STR_EQUAL(name, "policy")) {
+                return add_policy(&config_policies, &config_policies_num,
+                                  value);
+        }
+        if (STR_EQUAL(name, "exclude")) {
+                return add_exclude(&config_policies, &config_policies_num,
+                                   value);
+        }
+        if (STR_EQUAL(name, "seed")) {
+                return add_seed(&config_policies, &config_policies_num, value);
+        }
 
         for (size_t i = 0; OPTS[i].type != OPT_END; i++) {
                 if (!STR_EQUAL(OPTS[i].name, name)) {
@@ -222,6 +472,42 @@ static int section_config_handler(const char *name, const char *value)
                         *(int *)(OPTS[i].data) = (int)num;
                         break;
                 }
+                case OPT_ENUM: {
+                        size_t k = 0;
+
+                        while (OPTS[i].values[k] != NULL &&
+                               !STR_EQUAL(OPTS[i].values[k], value)) {
+                                k++;
+                        }
+                        if (OPTS[i].values[k] == NULL) {
+                                plog(LOG_WARN,
+                                     "unknown value '%s' for '%s',"
+                                     " defaulting to '%s'",
+                                     value, name, OPTS[i].values[0]);
+                                k = 0;
+                        }
+                        *(int *)(OPTS[i].data) = (int)k;
+                        break;
+                }
+                case OPT_SIZE: {
+                        char *unit = NULL;
+                        long long size = strtoll(value, &unit, 10);
+                        const char *units = "KMG";
+                        const char *found =
+                                (*unit != 0) ? strchr(units, toupper(*unit)) :
+                                               NULL;
+
+                        if (found != NULL) {
+                                size <<= 10 * (found - units + 1);
+                        } else if (*unit != 0) {
+                                plog(LOG_WARN,
+                                     "unknown size '%s' for '%s', ignoring",
+                                     value, name);
+                                break;
+                        }
+                        *(long long *)(OPTS[i].data) = size;
+                        break;
+                }
                 default:
                         continue;
                 }
@@ -232,19 +518,162 @@ static int section_config_handler(const char *name, const char *value)
 }
 
 // for [browsers] section, which only have keys for browser names, no values for each
+// scripts are only run once the whole file is parsed, as the options decide
+// which of them are needed
 static int section_browsers_handler(const char *name)
 {
-        struct Browser *browser = run_browser_sh(name);
+        if (browser_names_num == MAX_BROWSERS) {
+                plog(LOG_ERROR, "too many browsers");
+                return -1;
+        }
+        snprintf(browser_names[browser_names_num++], BROWSER_NAME_SIZE, "%s",
+                 name);
+        return 0;
+}
 
-        if (browser == NULL) {
-                plog(LOG_ERROR, "failed running browser script");
+static int load_browsers(void)
+{
+        for (size_t i = 0; i < browser_names_num; i++) {
+                if (!browser_needed(browser_names[i])) {
+                        plog(LOG_DEBUG, "skipping browser %s",
+                             browser_names[i]);
+                        continue;
+                }
+                struct Browser *browser = run_browser_sh(browser_names[i]);
+
+                if (browser == NULL) {
+                        plog(LOG_ERROR, "failed running browser script");
+                        return -1;
+                }
+                select_dirs(browser);
+
+                CONFIG.browsers[CONFIG.browsers_num] = browser;
+                (CONFIG.browsers_num)++;
+        }
+
+        for (size_t i = 0; i < selected_browsers_num; i++) {
+                size_t k = 0;
+
+                while (k < browser_names_num &&
+                       !STR_EQUAL(browser_names[k], selected_browsers[i])) {
+                        k++;
+                }
+                if (k == browser_names_num) {
+                        plog(LOG_WARN, "browser %s is not in the config",
+                             selected_browsers[i]);
+                }
+        }
+        for (size_t i = 0; i < selected_dirs_num; i++) {
+                bool found = false;
+
+                for (size_t k = 0; k < CONFIG.browsers_num; k++) {
+                        struct Browser *browser = CONFIG.browsers[k];
+
+                        for (size_t j = 0; j < browser->dirs_num; j++) {
+                                found |= STR_EQUAL(browser->dirs[j]->path,
+                                                   selected_dirs[i]);
+                        }
+                }
+                if (!found) {
+                        plog(LOG_WARN, "directory %s is not in any browser",
+                             selected_dirs[i]);
+                }
+        }
+
+        return 0;
+}
+
+int select_browser(const char *name)
+{
+        if (selected_browsers_num == MAX_BROWSERS) {
+                errno = ENOBUFS;
+                return -1;
+        }
+        snprintf(selected_browsers[selected_browsers_num++], BROWSER_NAME_SIZE,
+                 "%s", name);
+
+        return 0;
+}
+
+// path is expanded the same way as the paths of browser directories
+int select_dir(const char *path)
+{
+        if (selected_dirs_num == MAX_DIRS) {
+                errno = ENOBUFS;
+                return -1;
+        }
+        struct Dir *dir = new_dir(path, DIR_PROFILE, NULL);
+
+        if (dir == NULL) {
                 return -1;
         }
-        CONFIG.browsers[CONFIG.browsers_num] = browser;
-        (CONFIG.browsers_num)++;
+        snprintf(selected_dirs[selected_dirs_num++], PATH_MAX, "%s",
+                 dir->path);
+        free_dir(dir);
+
         return 0;
 }
 
+bool selection_active(void)
+{
+        return selected_browsers_num > 0 || selected_dirs_num > 0;
+}
+
+// true if any directory of browser is selected
+bool browser_selected(const struct Browser *browser)
+{
+        for (size_t i = 0; i < browser->dirs_num; i++) {
+                if (browser->dirs[i]->selected) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+// directories of other browsers are needed to find selected directories, and
+// to handle the overlay that's shared by all of them
+static bool browser_needed(const char *name)
+{
+#ifndef NOOVERLAY
+        if (CONFIG.enable_overlay) {
+                return true;
+        }
+#endif
+        return selected_browsers_num == 0 || selected_dirs_num > 0 ||
+               is_selected_browser(name);
+}
+
+static bool is_selected_browser(const char *name)
+{
+        for (size_t i = 0; i < selected_browsers_num; i++) {
+                if (STR_EQUAL(selected_browsers[i], name)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+static void select_dirs(struct Browser *browser)
+{
+        if (!selection_active() || is_selected_browser(browser->name)) {
+                return;
+        }
+
+        for (size_t i = 0; i < browser->dirs_num; i++) {
+                struct Dir *dir = browser->dirs[i];
+
+                dir->selected = false;
+
+                for (size_t k = 0; k < selected_dirs_num; k++) {
+                        if (STR_EQUAL(dir->path, selected_dirs[k])) {
+                                dir->selected = true;
+                        }
+                }
+        }
+}
+
 // find browser shell script
 static struct Browser *run_browser_sh(const char *browsername)
 {
@@ -284,6 +713,21 @@ static struct Browser *run_browser_sh(const char *browsername)
 
         plog(LOG_DEBUG, "found %s", found[0]);
 
+        // before the script's own, so that they take precedence
+        for (size_t i = 0; i < config_policies_num; i++) {
+                struct Policy *tmp =
+                        realloc(browser->policies,
+                                (browser->policies_num + 1) *
+                                        sizeof(struct Policy));
+
+                if (tmp == NULL) {
+                        err = -1;
+                        goto exit;
+                }
+                browser->policies = tmp;
+                browser->policies[browser->policies_num++] = config_policies[i];
+        }
+
         // only use first script found
         if (parse_browser_sh(found[0], browser) == -1) {
                 err = -1;
@@ -302,7 +746,8 @@ exit:
 }
 
 // parse output given by browser shell script
-// only initializes procname, dirs and dirs_num members
+// only initializes procname, dirs, dirs_num and policies members (which
+// holds the exclusions and seeds too)
 static int parse_browser_sh(const char *path, struct Browser *browser)
 {
         char *command = NULL;
@@ -355,6 +800,18 @@ static int parse_browser_sh_handler(void *user, const char *UNUSED(section),
                 snprintf(browser->procname, PROCNAME_SIZE, "%s", value);
                 return 1;
         }
+        if (STR_EQUAL(name, "policy")) {
+                return add_policy(&browser->policies, &browser->policies_num,
+                                  value) == 0;
+        }
+        if (STR_EQUAL(name, "exclude")) {
+                return add_exclude(&browser->policies, &browser->policies_num,
+                                   value) == 0;
+        }
+        if (STR_EQUAL(name, "seed")) {
+                return add_seed(&browser->policies, &browser->policies_num,
+                                value) == 0;
+        }
         struct Dir *dir = NULL;
 
         if (STR_EQUAL(name, "profile")) {
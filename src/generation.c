@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include "generation.h"
+#include "config.h"
+#include "log.h"
+#include "sync.h"
+#include "util.h"
+
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// generations are named after the time they were made at so that they sort
+// chronologically, the first characters of the name are their hour and day
+#define GENERATION_TIME_FORMAT "%Y-%m-%d_%H-%M-%S"
+#define GENERATION_HOUR_LEN 13
+#define GENERATION_DAY_LEN 10
+
+#define GENERATION_TMP_PREFIX ".tmp-"
+#define GENERATION_TRASH_PREFIX ".trash-"
+
+static void get_generations_dir(const char *backup, char *dir);
+static int get_generation_name(char *name, size_t size);
+static void remove_trash(const char *dir);
+
+bool generations_enabled(void)
+{
+        return CONFIG.generations_hourly > 0 || CONFIG.generations_daily > 0;
+}
+
+// make a new generation out of backup, files that didn't change since the
+// previous generation are hardlinked to it and the rest are reflinked (or
+// copied) from the backup
+int create_generation(const char *backup)
+{
+        struct stat sb;
+        char dir[PATH_MAX], name[64], path[PATH_MAX], tmp[PATH_MAX];
+        glob_t gb;
+
+        get_generations_dir(backup, dir);
+
+        if (get_generation_name(name, sizeof(name)) == -1 ||
+            create_dir(dir, 0700) == -1) {
+                return -1;
+        }
+        snprintf(path, PATH_MAX, "%s/%s", dir, name);
+        snprintf(tmp, PATH_MAX, "%s/" GENERATION_TMP_PREFIX "%s", dir, name);
+
+        // already made during this run
+        if (LEXISTS(path)) {
+                return 0;
+        }
+        // left over from an interrupted run
+        if (LEXISTS(tmp) && remove_path(tmp) == -1) {
+                return -1;
+        }
+        if (get_generations(backup, &gb) == -1) {
+                return -1;
+        }
+        const char *prev =
+                (gb.gl_pathc > 0) ? gb.gl_pathv[gb.gl_pathc - 1] : NULL;
+
+        plog(LOG_DEBUG, "creating generation %s of %s", name, backup);
+
+        // only made visible once complete
+        int err = link_path(backup, tmp, prev);
+
+        globfree(&gb);
+
+        if (err == 0 && rename(tmp, path) == -1) {
+                err = -1;
+        }
+        if (err == -1) {
+                int prev_errno = errno;
+
+                if (LEXISTS(tmp)) {
+                        remove_path(tmp);
+                }
+                errno = prev_errno;
+                return -1;
+        }
+
+        return prune_generations(backup);
+}
+
+// keep the newest generation of each of the last generations_hourly hours
+// and generations_daily days, the rest are moved to the trash and removed
+// in the background
+int prune_generations(const char *backup)
+{
+        char dir[PATH_MAX], hour[64] = { 0 }, day[64] = { 0 };
+        int hourly = 0, daily = 0;
+        glob_t gb;
+
+        get_generations_dir(backup, dir);
+
+        if (get_generations(backup, &gb) == -1) {
+                return -1;
+        }
+
+        // newest first, so the first one seen in an hour/day is kept
+        for (size_t i = gb.gl_pathc; i > 0; i--) {
+                const char *path = gb.gl_pathv[i - 1];
+                const char *name = strrchr(path, '/') + 1;
+                bool keep = false;
+
+                if (hourly < CONFIG.generations_hourly &&
+                    strncmp(name, hour, GENERATION_HOUR_LEN) != 0) {
+                        snprintf(hour, sizeof(hour), "%.*s",
+                                 GENERATION_HOUR_LEN, name);
+                        hourly++;
+                        keep = true;
+                }
+                if (daily < CONFIG.generations_daily &&
+                    strncmp(name, day, GENERATION_DAY_LEN) != 0) {
+                        snprintf(day, sizeof(day), "%.*s", GENERATION_DAY_LEN,
+                                 name);
+                        daily++;
+                        keep = true;
+                }
+                if (keep) {
+                        continue;
+                }
+                char trash[PATH_MAX];
+
+                snprintf(trash, PATH_MAX, "%s/" GENERATION_TRASH_PREFIX "%s",
+                         dir, name);
+
+                plog(LOG_DEBUG, "pruning generation %s", path);
+
+                if (rename(path, trash) == -1) {
+                        plog(LOG_WARN, "failed pruning generation %s", path);
+                        PERROR();
+                }
+        }
+        globfree(&gb);
+
+        remove_trash(dir);
+
+        return 0;
+}
+
+// put generation in place of backup by renaming it, the generation is gone
+// from the list afterwards
+int restore_generation(const char *backup, const char *name)
+{
+        struct stat sb;
+        char dir[PATH_MAX], path[PATH_MAX];
+
+        if (name[0] == '.' || strchr(name, '/') != NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        get_generations_dir(backup, dir);
+        snprintf(path, PATH_MAX, "%s/%s", dir, name);
+
+        if (!DIREXISTS(path)) {
+                errno = ENOENT;
+                return -1;
+        }
+
+        // its files are shared with other generations, which would change
+        // along with the backup when it's written to in place
+        if (unshare_links(path) == -1) {
+                return -1;
+        }
+
+        return replace_paths(backup, path);
+}
+
+// generations of backup, oldest first
+int get_generations(const char *backup, glob_t *gb)
+{
+        char dir[PATH_MAX], pattern[PATH_MAX];
+
+        get_generations_dir(backup, dir);
+        snprintf(pattern, PATH_MAX, "%s/*", dir);
+
+        int err = glob(pattern, GLOB_ONLYDIR, NULL, gb);
+
+        if (err != 0 && err != GLOB_NOMATCH) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static void get_generations_dir(const char *backup, char *dir)
+{
+        get_history_path(backup, PATHS.generations, GENERATION_ROOT_NAME, dir);
+}
+
+// every directory gets the same name during a run, so that they can be
+// rolled back together
+static int get_generation_name(char *name, size_t size)
+{
+        static char run_name[64] = { 0 };
+
+        if (run_name[0] == 0) {
+                time_t unixtime = time(NULL);
+                struct tm *time_info = NULL;
+
+                if (unixtime == (time_t)-1 ||
+                    (time_info = localtime(&unixtime)) == NULL ||
+                    strftime(run_name, sizeof(run_name),
+                             GENERATION_TIME_FORMAT, time_info) == 0) {
+                        return -1;
+                }
+        }
+        snprintf(name, size, "%s", run_name);
+
+        return 0;
+}
+
+// remove trash in a detached grandchild at idle priority, so that nothing
+// waits for it. whatever it doesn't get to is removed on the next prune
+static void remove_trash(const char *dir)
+{
+        char pattern[PATH_MAX];
+        glob_t gb;
+
+        snprintf(pattern, PATH_MAX, "%s/" GENERATION_TRASH_PREFIX "*", dir);
+
+        if (glob(pattern, GLOB_NOSORT, NULL, &gb) != 0) {
+                globfree(&gb);
+                return;
+        }
+        pid_t pid = fork();
+
+        if (pid == 0) {
+                if (fork() != 0) {
+                        _exit(0);
+                }
+                set_idle_priority();
+
+                for (size_t i = 0; i < gb.gl_pathc; i++) {
+                        remove_path(gb.gl_pathv[i]);
+                }
+                _exit(0);
+        } else if (pid == -1) {
+                plog(LOG_WARN, "failed removing pruned generations");
+                PERROR();
+        } else {
+                waitpid(pid, NULL, 0);
+        }
+        globfree(&gb);
+}
+
+// vim: sw=8 ts=8
@@ -0,0 +1,934 @@
+#define _GNU_SOURCE
+#include "hydrate.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+
+#include <linux/openat2.h>
+#include <sys/fanotify.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef NOOVERLAY
+
+// pre-content events were added in Linux 6.14
+#ifndef FAN_PRE_ACCESS
+#define FAN_PRE_ACCESS 0x00100000
+#endif
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+// placeholders hold the path of the file their content is in, relative to
+// the backup of their directory. the user can change it, so it's only ever
+// opened beneath that backup and with the user's own permissions. it's
+// prefixed with the mtime of that file and when the placeholder was made,
+// "<sec>.<nsec>:<sec>:<path>", to tell whether it was written to since.
+// the latter is 0 while the hydrator fills it in
+#define PLACEHOLDER_XATTR "user.bor.placeholder"
+
+struct Placeholder {
+        struct timespec mtime;
+        time_t made;
+        char rel[PATH_MAX];
+};
+
+static bool placeholders_supported(void);
+static int serve_events(int rootsfd_in);
+static int read_roots(int fd, char **buf, size_t *buf_len);
+static void handle_events(void);
+static bool answer_event(int fd, bool final);
+static void answer_pending(bool final);
+static const char *find_backup(int fd);
+static pid_t start_prefetcher(void);
+static int hydrate_fd(int fd, const char *backup);
+static int read_placeholder(int fd, struct Placeholder *ph);
+static int write_placeholder(int fd, const struct Placeholder *ph);
+static bool placeholder_changed(int fd);
+static int walk_placeholders(const char *path, const char *backup,
+                             bool hydrator);
+static int open_backup(const char *backup, const char *rel);
+static off_t fill_file(int fd, int srcfd);
+static bool is_placeholder(const char *path);
+static int create_entry(const char *path, const struct stat *sb, int typeflag,
+                        struct FTW *ftwbuf);
+static int copy_dir_metadata(const char *path, const struct stat *sb,
+                             int typeflag, struct FTW *ftwbuf);
+static int hydrate_entry(const char *path, const struct stat *sb,
+                         int typeflag, struct FTW *ftwbuf);
+static int prefetch_entry(const char *path, const struct stat *sb,
+                          int typeflag, struct FTW *ftwbuf);
+static int remove_entry(const char *path, const struct stat *sb, int typeflag,
+                        struct FTW *ftwbuf);
+
+// fanotify group that placeholders are marked in, and pipe used to tell
+// the hydrator which dirs to prefetch once syncing is done
+static int fanfd = -1;
+static int rootsfd = -1;
+
+// state for nftw callbacks
+static const char *walk_src = NULL, *walk_dest = NULL, *walk_backup = NULL;
+static bool walk_hydrator = false;
+static bool walk_failed = false;
+
+// in the hydrator: tmpfs dirs whose placeholders can be filled in, with
+// their backups, and events held back until theirs can be
+static char **root_tmpfs = NULL, **root_backup = NULL;
+static size_t roots_num = 0;
+static int *pending = NULL;
+static size_t pending_num = 0;
+
+// set up fanotify group and fork the process that fills in placeholders
+// from their backup when they are first accessed
+int start_hydrator(void)
+{
+        if (!check_caps_state(CAP_PERMITTED, CAP_SET, 2, CAP_SYS_ADMIN,
+                              CAP_DAC_OVERRIDE)) {
+                plog(LOG_WARN, "CAP_SYS_ADMIN and CAP_DAC_OVERRIDE "
+                               "is needed for lazy_sync");
+                errno = EPERM;
+                return -1;
+        }
+        // placeholders of the previous one may still be waiting
+        if (read_pid_file(PATHS.hydrate_pid) != -1) {
+                plog(LOG_WARN, "hydrator of previous sync is still running");
+                errno = EBUSY;
+                return -1;
+        }
+
+        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
+
+        fanfd = fanotify_init(FAN_CLASS_PRE_CONTENT | FAN_CLOEXEC,
+                              O_RDWR | O_LARGEFILE | O_CLOEXEC);
+        int prev_errno = errno;
+
+        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+
+        if (fanfd == -1) {
+                errno = prev_errno;
+                return -1;
+        }
+        if (!placeholders_supported()) {
+                plog(LOG_WARN, "kernel or tmpfs does not support "
+                               "pre-content events");
+                finish_hydrator();
+                errno = EOPNOTSUPP;
+                return -1;
+        }
+        int fds[2];
+
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+                finish_hydrator();
+                return -1;
+        }
+        pid_t pid = fork();
+
+        if (pid == -1) {
+                close(fds[0]);
+                close(fds[1]);
+                finish_hydrator();
+                return -1;
+        }
+        if (pid == 0) {
+                close(fds[1]);
+                _exit((serve_events(fds[0]) == -1) ? 1 : 0);
+        }
+        close(fds[0]);
+        rootsfd = fds[1];
+
+        char pidstr[32];
+
+        snprintf(pidstr, sizeof(pidstr), "%d\n", pid);
+
+        if (write_file(PATHS.hydrate_pid, pidstr) == -1) {
+                plog(LOG_ERROR, "failed saving pid of hydrator");
+                kill(pid, SIGTERM);
+                finish_hydrator();
+                return -1;
+        }
+
+        return 0;
+}
+
+bool hydrator_started(void)
+{
+        return fanfd != -1;
+}
+
+// hand everything over to the hydrator, which starts prefetching
+// once it sees that we are done
+void finish_hydrator(void)
+{
+        if (fanfd != -1) {
+                close(fanfd);
+                fanfd = -1;
+        }
+        if (rootsfd != -1) {
+                close(rootsfd);
+                rootsfd = -1;
+        }
+}
+
+int stop_hydrator(void)
+{
+        pid_t pid = read_pid_file(PATHS.hydrate_pid);
+
+        if (pid != -1) {
+                if (kill(pid, SIGTERM) == -1) {
+                        return -1;
+                }
+
+                // wait at most 5 seconds for it to exit
+                struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+
+                for (int i = 0; i < 500 && kill(pid, 0) == 0; i++) {
+                        nanosleep(&ts, NULL);
+                }
+                if (kill(pid, 0) == 0) {
+                        errno = EBUSY;
+                        return -1;
+                }
+        }
+        unlink(PATHS.hydrate_pid);
+
+        return 0;
+}
+
+// create tree of src in dest with metadata only, regular files are left
+// empty and filled in by the hydrator from their counterpart in the backup
+// once release_placeholders() was called
+int create_placeholders(const char *src, const char *dest)
+{
+        if (fanfd == -1) {
+                errno = EINVAL;
+                return -1;
+        }
+        walk_src = src;
+        walk_dest = dest;
+
+        if (nftw(src, create_entry, 32, FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+                return -1;
+        }
+        // creating entries changes mtime of dirs so do them afterwards.
+        // walks dest, which lacks what the copy filter left out
+        if (nftw(dest, copy_dir_metadata, 32, FTW_PHYS | FTW_DEPTH) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// tell the hydrator that the placeholders in dest can be filled in from
+// backup, which must be in place by now. access to them waits until then
+// (or until syncing is done, after which it's denied). they are prefetched
+// once syncing is done
+int release_placeholders(const char *dest, const char *backup)
+{
+        char real[PATH_MAX], line[PATH_MAX * 2 + 2];
+
+        if (rootsfd == -1) {
+                errno = EINVAL;
+                return -1;
+        }
+        // event fds are resolved to their real path
+        if (realpath(dest, real) == NULL) {
+                return -1;
+        }
+        ssize_t len = (ssize_t)snprintf(line, sizeof(line), "%s\n%s\n", real,
+                                        backup);
+
+        if (strchr(real, '\n') != NULL || strchr(backup, '\n') != NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return (write(rootsfd, line, len) == len) ? 0 : -1;
+}
+
+// fill in all placeholders under path from backup, by the hydrator if it's
+// running or directly otherwise
+int hydrate_tree(const char *path, const char *backup)
+{
+        return walk_placeholders(path, backup,
+                                 read_pid_file(PATHS.hydrate_pid) != -1);
+}
+
+// fill in placeholders under path left by a hydrator that is gone, nothing
+// keeps them from being read as zeroes or written to anymore. must be done
+// before placeholders of this run are made in path
+int hydrate_orphans(const char *path, const char *backup)
+{
+        struct stat sb;
+
+        // none were left, or their hydrator still watches them
+        if (!LEXISTS(PATHS.hydrate_pid) ||
+            (!hydrator_started() && read_pid_file(PATHS.hydrate_pid) != -1)) {
+                return 0;
+        }
+
+        return walk_placeholders(path, backup, false);
+}
+
+static int walk_placeholders(const char *path, const char *backup,
+                             bool hydrator)
+{
+        bool caps = check_caps_state(CAP_PERMITTED, CAP_SET, 1,
+                                     CAP_DAC_OVERRIDE);
+
+        walk_hydrator = hydrator;
+        walk_failed = false;
+        walk_backup = backup;
+
+        if (caps) {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
+        }
+        int err = nftw(path, hydrate_entry, 32, FTW_PHYS);
+
+        if (caps) {
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_DAC_OVERRIDE);
+        }
+
+        return (err == -1 || walk_failed) ? -1 : 0;
+}
+
+// remove placeholders that were never filled in under path,
+// their content is only in the backup
+int remove_placeholders(const char *path)
+{
+        return nftw(path, remove_entry, 32, FTW_PHYS);
+}
+
+// pre-content events need Linux 6.14 and a filesystem that allows them
+static bool placeholders_supported(void)
+{
+        char path[PATH_MAX];
+
+        snprintf(path, PATH_MAX, "%s/hydrate-probe", PATHS.runtime);
+
+        int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+
+        if (fd == -1) {
+                return false;
+        }
+        bool supported =
+                fsetxattr(fd, PLACEHOLDER_XATTR, "", 0, 0) == 0 &&
+                fanotify_mark(fanfd, FAN_MARK_ADD, FAN_PRE_ACCESS, fd, NULL) ==
+                        0;
+
+        if (supported) {
+                fanotify_mark(fanfd, FAN_MARK_REMOVE, FAN_PRE_ACCESS, fd, NULL);
+        }
+        close(fd);
+        unlink(path);
+
+        return supported;
+}
+
+// runs in the hydrator process, answers access to placeholders until
+// the prefetcher has filled in all of them
+static int serve_events(int rootsfd_in)
+{
+        // detach from the session so that we outlive it
+        int nullfd = open("/dev/null", O_RDWR);
+
+        if (nullfd != -1) {
+                dup2(nullfd, STDIN_FILENO);
+                dup2(nullfd, STDOUT_FILENO);
+                dup2(nullfd, STDERR_FILENO);
+                close(nullfd);
+        }
+        setsid();
+        if (chdir("/") == -1) {
+                return -1;
+        }
+
+        // placeholders may be read-only and event fds are opened with our
+        // credentials. it's dropped again to read the backups
+        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
+
+        struct pollfd pfds[2] = { { .fd = fanfd, .events = POLLIN },
+                                  { .fd = rootsfd_in, .events = POLLIN } };
+        char *buf = NULL;
+        size_t buf_len = 0;
+        pid_t prefetcher = -1;
+
+        for (;;) {
+                // check on prefetcher every now and then
+                int ret = poll(pfds, 2, (prefetcher > 0) ? 1000 : -1);
+
+                if (ret == -1 && errno != EINTR) {
+                        return -1;
+                }
+                // before the events, which may be for what it releases
+                if (ret > 0 && pfds[1].revents != 0) {
+                        int got = read_roots(rootsfd_in, &buf, &buf_len);
+
+                        if (got == -1) {
+                                return -1;
+                        }
+                        answer_pending(got == 0);
+
+                        // sync is done
+                        if (got == 0) {
+                                close(rootsfd_in);
+                                pfds[1].fd = -1;
+                                free(buf);
+                                buf = NULL;
+                                prefetcher = start_prefetcher();
+                        }
+                }
+                if (ret > 0 && (pfds[0].revents & POLLIN)) {
+                        handle_events();
+                }
+
+                int status = 0;
+
+                if (prefetcher > 0 &&
+                    waitpid(prefetcher, &status, WNOHANG) == prefetcher) {
+                        // keep denying access to whatever couldn't be
+                        // filled in, it would read as zeroes otherwise
+                        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+                                // no placeholders are left behind
+                                if (read_pid_file(PATHS.hydrate_pid) ==
+                                    getpid()) {
+                                        unlink(PATHS.hydrate_pid);
+                                }
+                                break;
+                        }
+                        prefetcher = 0;
+                }
+        }
+
+        return 0;
+}
+
+// read "<tmpfs>\n<backup>\n" pairs sent by release_placeholders() into the
+// roots, buf holds what's left of an incomplete one. returns 0 once there's
+// nothing left to read
+static int read_roots(int fd, char **buf, size_t *buf_len)
+{
+        char chunk[BUFSIZ];
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+
+        if (len == -1) {
+                return (errno == EINTR) ? 1 : 0;
+        }
+        if (len == 0) {
+                return 0;
+        }
+        char *tmp = realloc(*buf, *buf_len + len + 1);
+
+        if (tmp == NULL) {
+                return -1;
+        }
+        *buf = tmp;
+        memcpy(*buf + *buf_len, chunk, len);
+        *buf_len += len;
+        (*buf)[*buf_len] = 0;
+
+        char *first = NULL, *second = NULL;
+
+        while ((first = strchr(*buf, '\n')) != NULL &&
+               (second = strchr(first + 1, '\n')) != NULL) {
+                char **tmpfs = realloc(root_tmpfs,
+                                       (roots_num + 1) * sizeof(char *)),
+                     **backup = NULL;
+
+                if (tmpfs == NULL) {
+                        return -1;
+                }
+                root_tmpfs = tmpfs;
+                backup = realloc(root_backup, (roots_num + 1) * sizeof(char *));
+
+                if (backup == NULL) {
+                        return -1;
+                }
+                root_backup = backup;
+                root_tmpfs[roots_num] = strndup(*buf, first - *buf);
+                root_backup[roots_num] =
+                        strndup(first + 1, second - first - 1);
+
+                if (root_tmpfs[roots_num] == NULL ||
+                    root_backup[roots_num] == NULL) {
+                        free(root_tmpfs[roots_num]);
+                        free(root_backup[roots_num]);
+                        return -1;
+                }
+                roots_num++;
+                *buf_len -= second + 1 - *buf;
+                memmove(*buf, second + 1, *buf_len + 1);
+        }
+
+        return 1;
+}
+
+static void handle_events(void)
+{
+        char buf[4096];
+        ssize_t len = read(fanfd, buf, sizeof(buf));
+
+        for (ssize_t off = 0;
+             len > 0 &&
+             off + (ssize_t)sizeof(struct fanotify_event_metadata) <= len;) {
+                struct fanotify_event_metadata meta;
+
+                memcpy(&meta, buf + off, sizeof(meta));
+
+                if (meta.event_len < sizeof(meta)) {
+                        break;
+                }
+                off += meta.event_len;
+
+                if (meta.vers != FANOTIFY_METADATA_VERSION || meta.fd < 0) {
+                        continue;
+                }
+                if (!(meta.mask & FAN_PRE_ACCESS)) {
+                        struct fanotify_response resp = {
+                                .fd = meta.fd, .response = FAN_ALLOW
+                        };
+
+                        if (write(fanfd, &resp, sizeof(resp)) !=
+                            (ssize_t)sizeof(resp)) {
+                                plog(LOG_DEBUG, "failed responding to event");
+                        }
+                        close(meta.fd);
+                        continue;
+                }
+                if (answer_event(meta.fd, false)) {
+                        continue;
+                }
+                int *tmp = realloc(pending, (pending_num + 1) * sizeof(int));
+
+                // can't wait for it then
+                if (tmp == NULL) {
+                        answer_event(meta.fd, true);
+                        continue;
+                }
+                pending = tmp;
+                pending[pending_num++] = meta.fd;
+        }
+}
+
+// fill in the placeholder fd is for and let the access through, returns
+// false if its backup isn't in place yet. with final set access is denied
+// instead, as it never will be
+static bool answer_event(int fd, bool final)
+{
+        bool placeholder = fgetxattr(fd, PLACEHOLDER_XATTR, NULL, 0) >= 0;
+        const char *backup = placeholder ? find_backup(fd) : NULL;
+
+        if (placeholder && backup == NULL && !final) {
+                return false;
+        }
+        struct fanotify_response resp = { .fd = fd, .response = FAN_ALLOW };
+
+        if (placeholder && (backup == NULL || hydrate_fd(fd, backup) == -1)) {
+                resp.response = FAN_DENY;
+        }
+        if (write(fanfd, &resp, sizeof(resp)) != (ssize_t)sizeof(resp)) {
+                plog(LOG_DEBUG, "failed responding to event");
+        }
+        close(fd);
+
+        return true;
+}
+
+// try the events held back again, after roots were added
+static void answer_pending(bool final)
+{
+        size_t left = 0;
+
+        for (size_t i = 0; i < pending_num; i++) {
+                if (!answer_event(pending[i], final)) {
+                        pending[left++] = pending[i];
+                }
+        }
+        pending_num = left;
+}
+
+// backup of the released tmpfs dir that the file of fd is in, if any
+static const char *find_backup(int fd)
+{
+        char link[64], path[PATH_MAX] = { 0 };
+
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+
+        if (readlink(link, path, PATH_MAX - 1) == -1) {
+                return NULL;
+        }
+        for (size_t i = 0; i < roots_num; i++) {
+                size_t len = strlen(root_tmpfs[i]);
+
+                if (strncmp(path, root_tmpfs[i], len) == 0 &&
+                    path[len] == '/') {
+                        return root_backup[i];
+                }
+        }
+
+        return NULL;
+}
+
+// read a byte of every placeholder at idle priority so that
+// the hydrator fills them in
+static pid_t start_prefetcher(void)
+{
+        pid_t pid = fork();
+
+        if (pid != 0) {
+                return pid;
+        }
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        close(fanfd);
+
+        set_idle_priority();
+
+        walk_failed = false;
+
+        for (size_t i = 0; i < roots_num; i++) {
+                if (nftw(root_tmpfs[i], prefetch_entry, 32, FTW_PHYS) == -1) {
+                        walk_failed = true;
+                }
+        }
+
+        _exit(walk_failed ? 1 : 0);
+}
+
+// fill in placeholder from the file it points to in backup,
+// fd must not generate events (or there is no hydrator)
+static int hydrate_fd(int fd, const char *backup)
+{
+        struct Placeholder ph;
+
+        if (read_placeholder(fd, &ph) == -1) {
+                // already filled in
+                return (errno == ENODATA) ? 0 : -1;
+        }
+        struct stat sb;
+
+        if (fstat(fd, &sb) == -1) {
+                return -1;
+        }
+        int srcfd = open_backup(backup, ph.rel);
+
+        if (srcfd == -1) {
+                return -1;
+        }
+        ph.made = 0;
+
+        if (write_placeholder(fd, &ph) == -1) {
+                close(srcfd);
+                return -1;
+        }
+        off_t size = fill_file(fd, srcfd);
+
+        close(srcfd);
+
+        if (size == -1 || fremovexattr(fd, PLACEHOLDER_XATTR) == -1) {
+                return -1;
+        }
+        // no need to hear about it anymore, truncating generates
+        // events even through the fd of the event
+        if (fanfd != -1) {
+                fanotify_mark(fanfd, FAN_MARK_REMOVE, FAN_PRE_ACCESS, fd, NULL);
+        }
+        struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+
+        // backup could have changed since placeholder was made
+        if ((size != sb.st_size && ftruncate(fd, size) == -1) ||
+            futimens(fd, times) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static int read_placeholder(int fd, struct Placeholder *ph)
+{
+        char value[PATH_MAX + 64];
+        ssize_t len = fgetxattr(fd, PLACEHOLDER_XATTR, value,
+                                sizeof(value) - 1);
+
+        if (len == -1) {
+                return -1;
+        }
+        value[len] = 0;
+
+        long long mtime = 0, made = 0;
+        long nsec = 0;
+        int off = 0;
+
+        if (sscanf(value, "%lld.%ld:%lld:%n", &mtime, &nsec, &made, &off) !=
+                    3 ||
+            off == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        ph->mtime = (struct timespec){ .tv_sec = mtime, .tv_nsec = nsec };
+        ph->made = (time_t)made;
+        snprintf(ph->rel, PATH_MAX, "%s", value + off);
+
+        return 0;
+}
+
+static int write_placeholder(int fd, const struct Placeholder *ph)
+{
+        char value[PATH_MAX + 64];
+
+        snprintf(value, sizeof(value), "%lld.%09ld:%lld:%s",
+                 (long long)ph->mtime.tv_sec, ph->mtime.tv_nsec,
+                 (long long)ph->made, ph->rel);
+
+        return fsetxattr(fd, PLACEHOLDER_XATTR, value, strlen(value), 0);
+}
+
+// true if placeholder was written to or its metadata changed since it was
+// made, which can only happen once its hydrator is gone. changes right
+// after are ignored, its hydrator was still around then. one that the
+// hydrator was filling in when it went away only holds part of the backup
+static bool placeholder_changed(int fd)
+{
+        struct Placeholder ph;
+        struct stat sb;
+
+        if (read_placeholder(fd, &ph) == -1 || fstat(fd, &sb) == -1) {
+                return errno != ENODATA;
+        }
+
+        return ph.made != 0 &&
+               (sb.st_mtim.tv_sec != ph.mtime.tv_sec ||
+               sb.st_mtim.tv_nsec != ph.mtime.tv_nsec ||
+               sb.st_ctim.tv_sec > ph.made + 1);
+}
+
+// open rel beneath backup without following symlinks, and with the user's
+// own permissions as backups are theirs
+static int open_backup(const char *backup, const char *rel)
+{
+        bool dac = check_caps_state(CAP_EFFECTIVE, CAP_SET, 1,
+                                    CAP_DAC_OVERRIDE);
+
+        if (dac) {
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_DAC_OVERRIDE);
+        }
+        int rootfd = open(backup, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC),
+            srcfd = -1;
+
+        if (rootfd != -1) {
+                struct open_how how = {
+                        .flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC,
+                        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS
+                };
+
+                srcfd = (int)syscall(SYS_openat2, rootfd, rel, &how,
+                                     sizeof(how));
+        }
+        int prev_errno = errno;
+
+        if (rootfd != -1) {
+                close(rootfd);
+        }
+        if (dac) {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
+        }
+        errno = prev_errno;
+
+        return srcfd;
+}
+
+// returns size of what was copied
+static off_t fill_file(int fd, int srcfd)
+{
+        struct stat sb;
+
+        if (fstat(srcfd, &sb) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+                return -1;
+        }
+        off_t off = 0;
+
+        while (off < sb.st_size) {
+                ssize_t sent = sendfile(fd, srcfd, &off, sb.st_size - off);
+
+                if (sent == -1) {
+                        return -1;
+                }
+                if (sent == 0) {
+                        break;
+                }
+        }
+
+        return off;
+}
+
+static bool is_placeholder(const char *path)
+{
+        return lgetxattr(path, PLACEHOLDER_XATTR, NULL, 0) >= 0;
+}
+
+static int create_entry(const char *path, const struct stat *sb, int typeflag,
+                        struct FTW *UNUSED(ftwbuf))
+{
+        const char *rel = path + strlen(walk_src);
+        char dest[PATH_MAX];
+
+        snprintf(dest, PATH_MAX, "%s%s", walk_dest, rel);
+
+        if (copy_skips(path)) {
+                return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+        }
+        if (typeflag == FTW_D) {
+                return (*rel == 0) ? create_dir(dest, 0700) :
+                                     mkdir(dest, 0700);
+        } else if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+                errno = EACCES;
+                return -1;
+        } else if (S_ISLNK(sb->st_mode)) {
+                char target[PATH_MAX] = { 0 };
+
+                if (readlink(path, target, PATH_MAX - 1) == -1 ||
+                    symlink(target, dest) == -1) {
+                        return -1;
+                }
+        } else if (S_ISFIFO(sb->st_mode)) {
+                if (mkfifo(dest, 0600) == -1) {
+                        return -1;
+                }
+        } else if (S_ISREG(sb->st_mode)) {
+                int fd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                              0600);
+
+                if (fd == -1) {
+                        return -1;
+                }
+                int err = copy_xattrs(path, dest);
+                struct Placeholder ph = { .mtime = sb->st_mtim,
+                                          .made = time(NULL) };
+
+                snprintf(ph.rel, PATH_MAX, "%s", rel + 1);
+
+                // empty files don't need filling in
+                if (err == 0 && sb->st_size > 0) {
+                        err = (ftruncate(fd, sb->st_size) == -1 ||
+                               write_placeholder(fd, &ph) == -1 ||
+                               fanotify_mark(fanfd, FAN_MARK_ADD,
+                                             FAN_PRE_ACCESS, fd, NULL) == -1) ?
+                                      -1 :
+                                      0;
+                }
+                close(fd);
+
+                if (err == -1) {
+                        return -1;
+                }
+        } else {
+                // sockets and devices can't be copied meaningfully
+                return 0;
+        }
+
+        return copy_metadata(path, dest);
+}
+
+static int copy_dir_metadata(const char *path, const struct stat *UNUSED(sb),
+                             int typeflag, struct FTW *UNUSED(ftwbuf))
+{
+        if (typeflag != FTW_DP) {
+                return 0;
+        }
+        char src[PATH_MAX];
+
+        snprintf(src, PATH_MAX, "%s%s", walk_src, path + strlen(walk_dest));
+
+        return copy_metadata(src, path);
+}
+
+static int hydrate_entry(const char *path, const struct stat *sb,
+                         int UNUSED(typeflag), struct FTW *UNUSED(ftwbuf))
+{
+        if (!S_ISREG(sb->st_mode) || !is_placeholder(path)) {
+                return 0;
+        }
+        char c;
+
+        if (walk_hydrator) {
+                int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+                if (fd != -1) {
+                        if (read(fd, &c, 1) == -1) {
+                                plog(LOG_DEBUG, "hydrator failed for %s",
+                                     path);
+                        }
+                        close(fd);
+                }
+                if (!is_placeholder(path)) {
+                        return 0;
+                }
+        }
+
+        // hydrator is gone and so are its marks, what was written to the
+        // placeholder since then isn't overwritten
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+
+        if (fd != -1 && placeholder_changed(fd)) {
+                plog(LOG_ERROR,
+                     "placeholder %s was changed without its hydrator, "
+                     "not filling it in",
+                     path);
+                walk_failed = true;
+                close(fd);
+                return 0;
+        }
+        if (fd == -1 || hydrate_fd(fd, walk_backup) == -1) {
+                plog(LOG_ERROR, "failed filling in %s", path);
+                PERROR();
+                walk_failed = true;
+        }
+        if (fd != -1) {
+                close(fd);
+        }
+
+        return 0;
+}
+
+static int prefetch_entry(const char *path, const struct stat *sb,
+                          int UNUSED(typeflag), struct FTW *UNUSED(ftwbuf))
+{
+        if (!S_ISREG(sb->st_mode) || !is_placeholder(path)) {
+                return 0;
+        }
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        char c;
+
+        if (fd == -1 || read(fd, &c, 1) == -1 || is_placeholder(path)) {
+                walk_failed = true;
+        }
+        if (fd != -1) {
+                close(fd);
+        }
+
+        return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb,
+                        int UNUSED(typeflag), struct FTW *UNUSED(ftwbuf))
+{
+        if (S_ISREG(sb->st_mode) && is_placeholder(path) &&
+            unlink(path) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+#endif
+
+// vim: sw=8 ts=8
@@ -7,14 +7,44 @@
 
 #define MAX_BROWSERS 100
 
+#ifndef NOOVERLAY
+// what the lower layer of the overlay is made of
+enum OverlayLower { LOWER_DISK, LOWER_EROFS, LOWER_SQUASHFS };
+#endif
+
+// where excluded files are kept while synced
+enum ExcludeMode { EXCLUDE_DISK, EXCLUDE_RAM };
+
+// whether caches are copied to the tmpfs and back, or started empty and
+// thrown away (leaving the one on disk as it was, or clearing it)
+enum CacheMode { CACHE_COPY, CACHE_EPHEMERAL, CACHE_DISCARD };
+
 struct ConfigSkel {
 #ifndef NOOVERLAY
         bool enable_overlay;
+        bool rootless_overlay;
+        bool compact_overlay;
+        bool overlay_metacopy;
+        bool overlay_volatile;
+        int overlay_lower;
+        bool lazy_sync;
 #endif
         bool enable_cache;
         bool resync_cache;
+        int cache_mode;
+        bool durable_resync;
         bool reset_overlay;
+        bool snapshot_backups;
+        int generations_hourly;
+        int generations_daily;
         int max_log_entries;
+        int coalesce_resyncs;
+        long long resync_budget;
+        int resync_max_age;
+        int resync_quiet;
+        long long resync_bandwidth;
+        int resync_iops;
+        int exclude_mode;
         struct Browser *browsers[MAX_BROWSERS];
         size_t browsers_num;
 };
@@ -24,13 +54,37 @@ struct PathsSkel {
         char tmpfs[PATH_MAX];
         char config[PATH_MAX];
         char backups[PATH_MAX];
+        char snapshots[PATH_MAX];
+        char generations[PATH_MAX];
         char logs[PATH_MAX];
+        char journals[PATH_MAX];
+        char state[PATH_MAX];
+        char detached[PATH_MAX];
+        char lock[PATH_MAX];
+        char resynced[PATH_MAX];
         char share_dir[PATH_MAX];
         char share_dir_local[PATH_MAX];
+        // other backup roots in use, separated by ':'
+        char backup_roots[PATH_MAX];
 
 #ifndef NOOVERLAY
+        char mountpoint[PATH_MAX];
         char overlay_upper[PATH_MAX];
         char overlay_work[PATH_MAX];
+        char overlay_pid[PATH_MAX];
+        char overlay_opts[PATH_MAX];
+        char overlay_trash[PATH_MAX];
+        char overlay_retired[PATH_MAX];
+        char overlay_lower[PATH_MAX];
+        char lower_image[PATH_MAX];
+        char lower_mountpoint[PATH_MAX];
+        char standby_mountpoint[PATH_MAX];
+        char standby_tmpfs[PATH_MAX];
+        char standby_upper[PATH_MAX];
+        char standby_work[PATH_MAX];
+        char standby_lower_image[PATH_MAX];
+        char standby_lower_mountpoint[PATH_MAX];
+        char hydrate_pid[PATH_MAX];
 #endif
 };
 
@@ -39,5 +93,12 @@ extern struct PathsSkel PATHS;
 
 int init_paths(void);
 int init_config(bool save_config);
+int load_new_config(struct ConfigSkel *config);
+bool config_options_changed(void);
+int save_session_config(void);
+int select_browser(const char *name);
+int select_dir(const char *path);
+bool selection_active(void);
+bool browser_selected(const struct Browser *browser);
 
 // vim: sw=8 ts=8
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <glob.h>
+#include <stdbool.h>
+
+// name of generation roots beside backup roots on other filesystems
+#define GENERATION_ROOT_NAME ".bor-generations"
+
+bool generations_enabled(void);
+int create_generation(const char *backup);
+int prune_generations(const char *backup);
+int restore_generation(const char *backup, const char *name);
+int get_generations(const char *backup, glob_t *gb);
+
+// vim: sw=8 ts=8
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+
+#ifndef NOOVERLAY
+
+int start_hydrator(void);
+bool hydrator_started(void);
+void finish_hydrator(void);
+int stop_hydrator(void);
+int create_placeholders(const char *src, const char *dest);
+int release_placeholders(const char *dest, const char *backup);
+int hydrate_tree(const char *path, const char *backup);
+int hydrate_orphans(const char *path, const char *backup);
+int remove_placeholders(const char *path);
+
+#endif
+
+// vim: sw=8 ts=8
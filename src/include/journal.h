@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+int copy_journaled(const char *src, const char *dest);
+int journal_begin(const char *dest, const char *src);
+int journal_finish(const char *dest);
+bool journal_incomplete(const char *dest, char *src);
+
+// vim: sw=8 ts=8
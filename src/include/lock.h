@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+
+int lock_runtime(bool background);
+bool lock_cancelled(void);
+bool resync_coalesced(bool scheduled);
+int record_resync(void);
+
+// vim: sw=8 ts=8
@@ -1,12 +1,28 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 #ifndef NOOVERLAY
 
+// flags for merge_overlay()
+enum MergeFlags { MERGE_FINAL = 1 << 0, MERGE_KEEP_NEWER = 1 << 1 };
+
+int init_overlay(void);
 int mount_overlay(void);
 int unmount_overlay(void);
 bool overlay_mounted(void);
+const char *get_overlay_opts(void);
+bool overlay_lower_is_image(void);
+int merge_overlay(const char *upper, const char *merged, const char *lower,
+                  int flags);
+off_t merge_writes_avoided(void);
+int compact_overlay(const char *upper, const char *merged, const char *lower);
+int mount_standby_overlay(void);
+int swap_standby_overlay(void);
+int release_standby_overlay(void);
+bool retired_overlay_in_use(const char *retired);
+int remove_retired_overlay(const char *retired);
 
 #endif
 
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int add_policy(struct Policy **policies, size_t *policies_num,
+               const char *value);
+int add_exclude(struct Policy **policies, size_t *policies_num,
+                const char *glob);
+int add_seed(struct Policy **policies, size_t *policies_num, const char *glob);
+int set_policy_filter(struct Dir *dir, const char *root, bool final);
+int set_exclude_filter(struct Dir *dir, const char *root);
+void clear_policy_filter(void);
+
+// vim: sw=8 ts=8
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdbool.h>
+
+// files of a recovery dir that differ from the directory they belong to are
+// kept in RECOVERY_FILES, and listed in RECOVERY_INDEX
+#define RECOVERY_INDEX "index"
+#define RECOVERY_FILES "files"
+
+int save_recovery(struct Dir *dir, const char *stale, const char *recovery);
+bool is_recovery_bundle(const char *recovery);
+int print_recovery(const char *recovery, const char *indent);
+int restore_recovery(struct Dir *dir, const char *recovery,
+                     const char *pattern);
+
+// vim: sw=8 ts=8
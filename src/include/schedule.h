@@ -0,0 +1,21 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+// what's written to tmpfs directories but not flushed to their backups yet
+struct Risk {
+        off_t bytes;
+        // oldest flush of the directories with something at risk
+        time_t flushed;
+        // newest write to any of them
+        time_t written;
+};
+
+int add_dir_risk(struct Dir *dir, struct Risk *risk);
+bool resync_due(void);
+
+// vim: sw=8 ts=8
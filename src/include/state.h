@@ -0,0 +1,34 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+
+enum DirState { STATE_UNSYNCED, STATE_SYNCED, STATE_OVERLAY };
+
+static const char *const state_str[] = { "unsynced", "synced",
+                                         "synced (overlay)" };
+
+// the tmpfs of a directory was made the same as its backup
+struct Flush {
+        time_t at;
+        // bytes of unchanged files that weren't rewritten
+        off_t avoided;
+        // by a resync (rather than a sync or rollback)
+        bool resync;
+};
+
+bool state_unchanged(struct Dir *dir, const char *backup, const char *tmpfs);
+enum DirState get_dir_state(struct Dir *dir, const char *backup,
+                            const char *tmpfs);
+int record_state(struct Dir *dir, const char *backup, const char *tmpfs,
+                 const struct Flush *flush);
+time_t get_flush_time(struct Dir *dir);
+off_t get_writes_avoided(struct Dir *dir);
+long long get_resync_count(struct Dir *dir);
+int refresh_state(struct Dir *dir, const char *backup, const char *tmpfs);
+int forget_state(struct Dir *dir);
+
+// vim: sw=8 ts=8
@@ -6,6 +6,11 @@
 
 #define BOR_CRASH_PREFIX "bor-crash_"
 
+// name of backup roots on filesystems other than the config dir's
+#define BACKUP_ROOT_NAME ".bor-backups"
+// same for snapshots of backups, so that they can share extents
+#define SNAPSHOT_ROOT_NAME ".bor-snapshots"
+
 enum Action {
         ACTION_NONE,
         ACTION_SYNC,
@@ -13,17 +18,39 @@ enum Action {
         ACTION_RESYNC,
         ACTION_STATUS,
         ACTION_RMRECOVERY,
-        ACTION_RMCACHE
+        ACTION_RMCACHE,
+        ACTION_ROLLBACK,
+        ACTION_RESTORE,
+        ACTION_DETACH,
+        ACTION_ATTACH,
+        ACTION_RELOAD
+};
+// const so that files that include this but don't use it don't warn
+static const char *const action_str[] = {
+        "none",     "sync",        "unsync",   "resync",  "status",
+        "recovery", "clear cache", "rollback", "restore", "detach",
+        "attach",   "reload"
 };
-static char *action_str[] = { "none",   "sync",     "unsync",     "resync",
-                              "status", "recovery", "clear cache" };
 
 int do_action_on_browser(struct Browser *browser, enum Action action,
                          bool overlay);
+int do_action_on_dir(struct Dir *dir, enum Action action, bool overlay,
+                     bool skip_caches);
+size_t do_action_by_value(enum Action action, bool overlay);
 #ifndef NOOVERLAY
 int reset_overlay(void);
+int remount_overlay(void);
+int repoint_dirs(const char *target);
+int reclaim_overlays(bool force);
 #endif
 int get_paths(struct Dir *dir, char *backup, char *tmpfs);
+void init_backup_roots(void);
+bool backup_is_remote(struct Dir *dir, const char *backup);
+void get_history_path(const char *backup, const char *default_root,
+                      const char *root_name, char *path);
+void set_rollback_generation(const char *name);
 int get_overlay_paths(struct Dir *dir, char *tmpfs);
+bool cache_ephemeral(struct Dir *dir);
+bool dir_resynced(struct Dir *dir);
 
 // vim: sw=8 ts=8
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
 
 #define BROWSER_NAME_SIZE 100
@@ -9,12 +10,34 @@
 
 enum DirType { DIR_CACHE, DIR_PROFILE };
 
+// how often files are resynced, set per glob with policy = <class> <glob>.
+// excluded ones (exclude = <glob>) aren't copied to the tmpfs at all, and
+// seeds (seed = <glob>) are the only ones copied into ephemeral caches
+enum PolicyClass {
+        POLICY_ALWAYS,
+        POLICY_EVERY,
+        POLICY_UNSYNC,
+        POLICY_NEVER,
+        POLICY_EXCLUDE,
+        POLICY_SEED
+};
+
+struct Policy {
+        enum PolicyClass class;
+        // resyncs between copies for POLICY_EVERY
+        int every;
+        // a name, or a path relative to the directory if it starts with '/'
+        char glob[PATH_MAX];
+};
+
 struct Dir {
         char path[PATH_MAX];
         char parent_path[PATH_MAX];
         char dirname[NAME_MAX];
         enum DirType type;
         struct Browser *browser;
+        // chosen with --browser or --dir (all are if neither is given)
+        bool selected;
 };
 
 struct Browser {
@@ -22,6 +45,10 @@ struct Browser {
         char procname[PROCNAME_SIZE];
         struct Dir *dirs[MAX_DIRS];
         size_t dirs_num;
+        // first match wins, those from bor.conf come first. exclusions
+        // are always matched before the rest
+        struct Policy *policies;
+        size_t policies_num;
 };
 
 struct Dir *new_dir(const char *path, enum DirType type,
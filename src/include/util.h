@@ -39,6 +39,9 @@
 
 #define MIB 1024
 
+// CLONE_PATH_REFLINK -> fail rather than copy file data
+enum CloneFlags { CLONE_PATH_REFLINK = 1 << 0 };
+
 #define LOGCWD()                                       \
         do {                                           \
                 char logcwd_cwd[PATH_MAX];             \
@@ -66,6 +69,16 @@ void free_str_array(char **arr, size_t arr_len);
 int trim(char *str);
 
 int copy_path(const char *src, const char *dest, bool include_root);
+void set_deadline(long seconds);
+long deadline_left(void);
+void set_io_limits(long long bandwidth, long long ops);
+void set_idle_priority(void);
+void set_copy_filter(const char *root, char **rules, size_t rules_num);
+bool copy_skips(const char *path);
+bool path_matches(const char *root, const char *path, const char *glob);
+int clone_path(const char *src, const char *dest, int flags);
+int link_path(const char *src, const char *dest, const char *link_dest);
+int unshare_links(const char *path);
 int remove_dir(const char *path);
 int remove_path(const char *path);
 int clear_dir(const char *path);
@@ -89,6 +102,15 @@ bool program_exists(const char *program);
 void update_string(char *str, size_t size, const char *input);
 bool name_is_dot(const char *name);
 int copy_rfile(const char *src, const char *dest);
+int copy_file(const char *src, const char *dest);
+int copy_metadata(const char *src, const char *dest);
+int copy_xattrs(const char *src, const char *dest);
+bool files_identical(const char *path1, const char *path2);
+int sync_filesystem(const char *path);
+char **get_open_files(size_t *len);
+bool files_open_on(dev_t dev);
+int write_file(const char *path, const char *str);
+pid_t read_pid_file(const char *path);
 
 // from teeny-sha1.c
 int sha1digest(uint8_t *digest, char *hexdigest, const uint8_t *data,
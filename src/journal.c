@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// a journal records the progress of copying a directory into the tmpfs, so
+// that an interrupted copy is known to be incomplete and can be resumed.
+// the first line is "src <path>", then "done <name>" for each entry of the
+// directory that was copied entirely. it's removed once the copy is done
+#define JOURNAL_SRC "src "
+#define JOURNAL_DONE "done "
+
+static void get_journal_path(const char *dest, char *path);
+static char *read_journal(const char *dest, char *src);
+static bool entry_done(const char *journal, const char *name);
+
+// copy src to dest (which must not exist unless resuming) entry by entry,
+// skipping those that an interrupted copy already finished
+int copy_journaled(const char *src, const char *dest)
+{
+        struct stat sb;
+        char jsrc[PATH_MAX] = { 0 }, path[PATH_MAX];
+        char *journal = NULL;
+
+        bool incomplete = journal_incomplete(dest, jsrc);
+
+        if (incomplete && STR_EQUAL(jsrc, src)) {
+                plog(LOG_INFO, "resuming interrupted copy of %s", src);
+                journal = read_journal(dest, jsrc);
+        } else {
+                // left over from copying something else, start over
+                if (incomplete && LEXISTS(dest) && remove_path(dest) == -1) {
+                        return -1;
+                }
+                if (LEXISTS(dest)) {
+                        errno = EEXIST;
+                        return -1;
+                }
+                if (journal_begin(dest, src) == -1) {
+                        return -1;
+                }
+        }
+        get_journal_path(dest, path);
+
+        FILE *fp = fopen(path, "a");
+        DIR *dp = opendir(src);
+        struct dirent *de = NULL;
+        int err = 0;
+
+        if (fp == NULL || dp == NULL ||
+            (mkdir(dest, 0700) == -1 && errno != EEXIST)) {
+                err = -1;
+                goto exit;
+        }
+
+        while ((de = readdir(dp)) != NULL) {
+                if (name_is_dot(de->d_name) ||
+                    (journal != NULL && entry_done(journal, de->d_name))) {
+                        continue;
+                }
+                char src_entry[PATH_MAX], dest_entry[PATH_MAX];
+
+                snprintf(src_entry, PATH_MAX, "%s/%s", src, de->d_name);
+                snprintf(dest_entry, PATH_MAX, "%s/%s", dest, de->d_name);
+
+                if (copy_skips(src_entry)) {
+                        continue;
+                }
+
+                // partially copied, start this one over
+                if (LEXISTS(dest_entry) && remove_path(dest_entry) == -1) {
+                        err = -1;
+                        goto exit;
+                }
+                if (clone_path(src_entry, dest_entry, 0) == -1) {
+                        err = -1;
+                        goto exit;
+                }
+                // names with newlines are just copied again when resuming
+                if (strchr(de->d_name, '\n') == NULL) {
+                        fprintf(fp, JOURNAL_DONE "%s\n", de->d_name);
+                        fflush(fp);
+                }
+        }
+
+        if (copy_xattrs(src, dest) == -1 || copy_metadata(src, dest) == -1) {
+                err = -1;
+                goto exit;
+        }
+
+exit:
+        if (dp != NULL) {
+                closedir(dp);
+        }
+        if (fp != NULL) {
+                fclose(fp);
+        }
+        free(journal);
+
+        if (err == 0) {
+                err = journal_finish(dest);
+        }
+
+        return err;
+}
+
+// mark dest as being copied from src until journal_finish() is called
+int journal_begin(const char *dest, const char *src)
+{
+        char path[PATH_MAX], dir[PATH_MAX];
+
+        get_journal_path(dest, path);
+        snprintf(dir, PATH_MAX, "%s", path);
+
+        if (create_dir(dirname(dir), 0700) == -1) {
+                return -1;
+        }
+
+        FILE *fp = fopen(path, "w");
+
+        if (fp == NULL) {
+                return -1;
+        }
+        fprintf(fp, JOURNAL_SRC "%s\n", src);
+
+        return (fclose(fp) == EOF) ? -1 : 0;
+}
+
+int journal_finish(const char *dest)
+{
+        char path[PATH_MAX];
+
+        get_journal_path(dest, path);
+
+        if (unlink(path) == -1 && errno != ENOENT) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// true if a copy into dest was interrupted, src is set to what it was
+// copying from
+bool journal_incomplete(const char *dest, char *src)
+{
+        char *journal = read_journal(dest, src);
+        bool incomplete = (journal != NULL);
+
+        free(journal);
+
+        return incomplete;
+}
+
+// journals are in the runtime dir, so they go away along with the tmpfs
+static void get_journal_path(const char *dest, char *path)
+{
+        char tmp[PATH_MAX];
+
+        snprintf(tmp, PATH_MAX, "%s", dest);
+        snprintf(path, PATH_MAX, "%s/%s", PATHS.journals, basename(tmp));
+}
+
+// returns the contents of the journal of dest (to be freed), or NULL if there
+// is none. src is set to its source
+static char *read_journal(const char *dest, char *src)
+{
+        char path[PATH_MAX];
+
+        get_journal_path(dest, path);
+
+        FILE *fp = fopen(path, "r");
+
+        if (fp == NULL) {
+                return NULL;
+        }
+        char *journal = NULL;
+        size_t size = 0;
+
+        if (getdelim(&journal, &size, 0, fp) == -1 ||
+            strncmp(journal, JOURNAL_SRC, strlen(JOURNAL_SRC)) != 0) {
+                free(journal);
+                fclose(fp);
+                return NULL;
+        }
+        fclose(fp);
+
+        const char *start = journal + strlen(JOURNAL_SRC);
+
+        snprintf(src, PATH_MAX, "%.*s", (int)strcspn(start, "\n"), start);
+
+        return journal;
+}
+
+static bool entry_done(const char *journal, const char *name)
+{
+        char line[PATH_MAX];
+
+        snprintf(line, PATH_MAX, "\n" JOURNAL_DONE "%s\n", name);
+
+        return strstr(journal, line) != NULL;
+}
+
+// vim: sw=8 ts=8
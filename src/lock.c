@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "lock.h"
+#include "config.h"
+#include "log.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// only one instance of bor does anything at a time. the lock is a POSIX
+// record lock on PATHS.lock, which unlike flock isn't inherited by the
+// processes that are forked off (hydrator, namespace holder...), so it goes
+// away as soon as this one exits. the lock file holds the pid of its owner and
+// whether it's a background (timed) resync, which others may cancel
+#define LOCK_BACKGROUND "background"
+
+// how often to check on the owner of the lock while waiting for it
+#define LOCK_POLL_NSEC 100000000
+
+static pid_t try_lock(int fd);
+static bool cancel_owner(int fd, pid_t owner);
+static void on_cancel(int sig);
+static long long now(void);
+
+static volatile sig_atomic_t cancelled = 0;
+static bool waited = false;
+// when this instance was started and when it got the lock, in milliseconds
+static long long requested = 0, acquired = 0;
+
+// wait until no other instance is running. unless background is set, a
+// background resync that's running is asked to stop early
+int lock_runtime(bool background)
+{
+        requested = now();
+
+        // before anyone can see that this is a background resync
+        if (background) {
+                struct sigaction sa = { .sa_handler = on_cancel,
+                                        .sa_flags = SA_RESTART };
+
+                sigemptyset(&sa.sa_mask);
+                sigaction(SIGUSR1, &sa, NULL);
+        }
+        if (create_dir(PATHS.runtime, 0755) == -1) {
+                return -1;
+        }
+        // never closed, that would release the lock
+        int fd = open(PATHS.lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd == -1) {
+                return -1;
+        }
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = LOCK_POLL_NSEC };
+        pid_t owner, waiting_for = 0;
+        bool asked = false;
+
+        while ((owner = try_lock(fd)) != 0) {
+                if (owner == -1 || deadline_left() == 0) {
+                        if (owner != -1) {
+                                errno = ETIME;
+                        }
+                        close(fd);
+                        return -1;
+                }
+                if (owner != waiting_for) {
+                        plog(LOG_INFO,
+                             "waiting for another instance (pid %d) to finish",
+                             owner);
+                        waiting_for = owner;
+                        waited = true;
+                        asked = false;
+                }
+                if (!background && !asked) {
+                        asked = cancel_owner(fd, owner);
+                }
+                nanosleep(&ts, NULL);
+        }
+        acquired = now();
+
+        char content[64];
+
+        snprintf(content, sizeof(content), "%d%s\n", getpid(),
+                 background ? " " LOCK_BACKGROUND : "");
+
+        if (ftruncate(fd, 0) == -1 ||
+            pwrite(fd, content, strlen(content), 0) == -1) {
+                plog(LOG_WARN, "failed writing %s", PATHS.lock);
+                PERROR();
+        }
+
+        return 0;
+}
+
+// true if a more urgent instance wants this one to stop
+bool lock_cancelled(void)
+{
+        return cancelled != 0;
+}
+
+// true if a full resync finished while this instance waited, making another
+// one redundant. unless scheduled, it must have started after this one was
+// asked for, as what was written before then has to be flushed. the timer
+// may also reuse one that started at most coalesce_resyncs seconds before
+bool resync_coalesced(bool scheduled)
+{
+        char buf[32] = { 0 };
+
+        if (!waited) {
+                return false;
+        }
+        FILE *fp = fopen(PATHS.resynced, "r");
+
+        if (fp == NULL) {
+                return false;
+        }
+        bool read = (fgets(buf, sizeof(buf), fp) != NULL);
+
+        fclose(fp);
+
+        if (!read) {
+                return false;
+        }
+        long long started = strtoll(buf, NULL, 10);
+
+        if (!scheduled) {
+                return started >= requested;
+        }
+
+        return CONFIG.coalesce_resyncs > 0 &&
+               started >= requested - CONFIG.coalesce_resyncs * 1000LL;
+}
+
+// remember that a full resync was done, it started once the lock was taken
+int record_resync(void)
+{
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "%lld\n", acquired);
+
+        return write_file(PATHS.resynced, buf);
+}
+
+// returns 0 once the lock is taken, else the pid of its owner
+static pid_t try_lock(int fd)
+{
+        struct flock fl;
+
+        // released in the meantime, try again
+        do {
+                fl = (struct flock){ .l_type = F_WRLCK, .l_whence = SEEK_SET };
+
+                if (fcntl(fd, F_SETLK, &fl) == 0) {
+                        return 0;
+                }
+                if ((errno != EACCES && errno != EAGAIN) ||
+                    fcntl(fd, F_GETLK, &fl) == -1) {
+                        return -1;
+                }
+        } while (fl.l_type == F_UNLCK);
+
+        return fl.l_pid;
+}
+
+// ask the owner to stop if it's a background resync, returns false if it
+// can't be told yet
+static bool cancel_owner(int fd, pid_t owner)
+{
+        char content[64] = { 0 };
+        char *flag = NULL;
+
+        // the lock file may not have been written yet by a new owner
+        if (pread(fd, content, sizeof(content) - 1, 0) <= 0 ||
+            strtol(content, &flag, 10) != owner) {
+                return false;
+        }
+        if (strncmp(flag, " " LOCK_BACKGROUND, strlen(LOCK_BACKGROUND) + 1) !=
+            0) {
+                return true;
+        }
+        plog(LOG_INFO, "asking background resync (pid %d) to stop", owner);
+
+        if (kill(owner, SIGUSR1) == -1) {
+                plog(LOG_WARN, "failed asking pid %d to stop", owner);
+                PERROR();
+        }
+
+        return true;
+}
+
+static void on_cancel(int UNUSED(sig))
+{
+        cancelled = 1;
+}
+
+// seconds since boot, which keep counting while suspended
+static long long now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_BOOTTIME, &ts);
+
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// vim: sw=8 ts=8
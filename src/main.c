@@ -2,6 +2,13 @@
 #include "log.h"
 #include "sync.h"
 #include "overlay.h"
+#include "policy.h"
+#include "hydrate.h"
+#include "lock.h"
+#include "generation.h"
+#include "recovery.h"
+#include "schedule.h"
+#include "state.h"
 #include "util.h"
 
 #include <dirent.h>
@@ -21,6 +28,12 @@
 #endif
 
 int do_action(enum Action action);
+int reload_dirs(bool overlay, size_t *synced);
+int replace_session_browsers(struct Browser **browsers, size_t browsers_num);
+void free_browsers(struct ConfigSkel *config);
+bool browser_synced(struct Browser *browser);
+bool anything_synced(void);
+bool dir_in_config(const struct ConfigSkel *config, const struct Dir *dir);
 
 int init(bool save_config);
 int uninit(void);
@@ -28,6 +41,7 @@ int uninit(void);
 int check_runtime_space(void);
 
 int clear_recovery_dirs(void);
+int restore_recovery_dirs(const char *pattern);
 int remove_glob(glob_t *gb);
 int get_recovery_dirs(struct Dir *target_dir, glob_t *glob_struct);
 
@@ -48,13 +62,27 @@ int main(int argc, char **argv)
                                          { "clean", no_argument, NULL, 'c' },
                                          { "rm_cache", no_argument, NULL, 'x' },
                                          { "status", no_argument, NULL, 'p' },
+                                         { "rollback", optional_argument, NULL, 'R' },
+                                         { "restore", optional_argument, NULL, 'e' },
+                                         { "detach", no_argument, NULL, 'd' },
+                                         { "attach", no_argument, NULL, 'a' },
+                                         { "reload", no_argument, NULL, 'l' },
+                                         { "browser", required_argument, NULL, 'b' },
+                                         { "dir", required_argument, NULL, 'D' },
+                                         { "background", no_argument, NULL, 'B' },
+                                         { "deadline", required_argument, NULL, 't' },
+                                         { "scheduled", no_argument, NULL, 'S' },
                                          { NULL, 0, NULL, 0 } };
         // clang-format on
 
         int opt, opt_index;
         enum Action action = ACTION_NONE;
+        const char *restore_pattern = NULL;
+        bool background = false, scheduled = false;
+        long deadline = 0;
+        char *end = NULL;
 
-        while ((opt = getopt_long(argc, argv, "Vvhsurcxp", long_options,
+        while ((opt = getopt_long(argc, argv, "VvhsurcxpR::e::dalb:D:Bt:S", long_options,
                                   &opt_index)) != -1) {
                 switch (opt) {
                 case 'V':
@@ -84,20 +112,106 @@ int main(int argc, char **argv)
                 case 'p':
                         action = ACTION_STATUS;
                         break;
+                case 'R':
+                        action = ACTION_ROLLBACK;
+                        if (optarg != NULL) {
+                                set_rollback_generation(optarg);
+                        }
+                        break;
+                case 'e':
+                        action = ACTION_RESTORE;
+                        restore_pattern = optarg;
+                        break;
+                case 'd':
+                        action = ACTION_DETACH;
+                        break;
+                case 'a':
+                        action = ACTION_ATTACH;
+                        break;
+                case 'l':
+                        action = ACTION_RELOAD;
+                        break;
+                case 'b':
+                        if (select_browser(optarg) == -1) {
+                                plog(LOG_ERROR, "failed selecting browser %s",
+                                     optarg);
+                                PERROR();
+                                return 1;
+                        }
+                        break;
+                case 'D':
+                        if (select_dir(optarg) == -1) {
+                                plog(LOG_ERROR, "failed selecting directory %s",
+                                     optarg);
+                                PERROR();
+                                return 1;
+                        }
+                        break;
+                case 'B':
+                        background = true;
+                        break;
+                case 'S':
+                        scheduled = true;
+                        break;
+                case 't':
+                        deadline = strtol(optarg, &end, 10);
+
+                        if (*end != 0 || deadline <= 0) {
+                                plog(LOG_ERROR, "invalid deadline %s", optarg);
+                                return 1;
+                        }
+                        break;
                 default:
                         return 0;
                 }
         }
+        // other actions are about every directory at once
+        if (selection_active() && action != ACTION_SYNC &&
+            action != ACTION_UNSYNC && action != ACTION_RESYNC &&
+            action != ACTION_RMCACHE && action != ACTION_STATUS) {
+                plog(LOG_ERROR, "--browser and --dir can only be used with "
+                                "sync, unsync, resync, rm_cache and status");
+                return 1;
+        }
+
+        if (background && action != ACTION_RESYNC) {
+                plog(LOG_ERROR, "--background can only be used with resync");
+                return 1;
+        }
+        if (scheduled && action != ACTION_RESYNC) {
+                plog(LOG_ERROR, "--scheduled can only be used with resync");
+                return 1;
+        }
+
+        if (deadline > 0 && action != ACTION_RESYNC &&
+            action != ACTION_UNSYNC) {
+                plog(LOG_ERROR,
+                     "--deadline can only be used with resync and unsync");
+                return 1;
+        } else if (deadline > 0) {
+                set_deadline(deadline);
+        }
+
         if (action == ACTION_STATUS) {
                 print_status();
                 return 0;
         } else if (action == ACTION_RMRECOVERY) {
                 return (clear_recovery_dirs() == -1) ? 1 : 0;
+        } else if (action == ACTION_RESTORE) {
+                return (restore_recovery_dirs(restore_pattern) == -1) ? 1 : 0;
         }
         if (action == ACTION_NONE) {
                 return 0;
         }
 
+        // one instance at a time, what's read while initializing may be
+        // changed by the others
+        if (init_paths() == -1 || lock_runtime(background) == -1) {
+                plog(LOG_ERROR, "failed locking runtime directory");
+                PERROR();
+                return 1;
+        }
+
         // init everything before doing the given action
         if (init(true) == -1) {
                 plog(LOG_ERROR, "failed initializing");
@@ -125,6 +239,21 @@ int main(int argc, char **argv)
                 return 1;
         }
 
+        // reuse a resync that was done while waiting for the lock
+        if (action == ACTION_RESYNC && resync_coalesced(scheduled)) {
+                plog(LOG_INFO, "everything was just resynced, skipping");
+                return 0;
+        }
+        // the timer runs often, resyncs only go through when needed
+        if (scheduled && !resync_due()) {
+                return 0;
+        }
+        // out of the way of everything else, unless it has to be done in time
+        if (background && deadline_left() == -1) {
+                set_idle_priority();
+                set_io_limits(CONFIG.resync_bandwidth, CONFIG.resync_iops);
+        }
+
         if (do_action(action) == -1) {
                 plog(LOG_ERROR, "failed attempting to do %s",
                      action_str[action]);
@@ -137,20 +266,31 @@ int main(int argc, char **argv)
 // loop through configured browsers and do sync/unsync/resync on them
 int do_action(enum Action action)
 {
+        struct stat sb;
         size_t did_action = 0;
         bool overlay = false;
 
+        // nothing was left to attach to
+        if (action == ACTION_ATTACH && !FEXISTS(PATHS.detached)) {
+                plog(LOG_WARN, "not detached, syncing instead");
+                action = ACTION_SYNC;
+        }
+
 #ifndef NOOVERLAY
         // check if we have required capabilities
         // do it before any action so that unsync/resync
         // works properly in case we don't
-        if (CONFIG.enable_overlay &&
+        // (not needed if rootless)
+        if (CONFIG.enable_overlay && !CONFIG.rootless_overlay &&
             !check_caps_state(CAP_PERMITTED, CAP_SET, 2, CAP_SYS_ADMIN,
                               CAP_DAC_OVERRIDE)) {
                 plog(LOG_WARN, "CAP_SYS_ADMIN and CAP_DAC_OVERRIDE "
-                               "is needed for overlay feature");
+                               "is needed for overlay feature "
+                               "(or enable rootless_overlay)");
         } else if (CONFIG.enable_overlay) {
-                if (action == ACTION_SYNC && overlay_mounted()) {
+                // unless more directories are added to it
+                if (action == ACTION_SYNC && overlay_mounted() &&
+                    !selection_active()) {
                         plog(LOG_WARN, "tmpfs is already mounted, aborting");
                         return -1;
                 }
@@ -164,9 +304,51 @@ int do_action(enum Action action)
         }
 #endif
 
-        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+#ifndef NOOVERLAY
+        // only create placeholders in tmpfs, and fill them in when accessed
+        if ((action == ACTION_SYNC || action == ACTION_ATTACH) && !overlay &&
+            CONFIG.lazy_sync && start_hydrator() == -1) {
+                plog(LOG_WARN, "lazy sync is not possible, copying in full");
+                PERROR();
+        }
+#endif
+
+#ifndef NOOVERLAY
+        // old overlays that files are no longer open on are merged again,
+        // all of them before unsyncing as nothing would merge them after
+        if ((action == ACTION_RESYNC || action == ACTION_UNSYNC) && overlay &&
+            overlay_mounted() &&
+            reclaim_overlays(action == ACTION_UNSYNC) == -1) {
+                plog(LOG_WARN, "failed reclaiming old overlays");
+        }
+#endif
+
+        size_t synced = 0, selected = 0;
+        bool by_value = (deadline_left() != -1);
+
+        if (action == ACTION_RELOAD) {
+                if (reload_dirs(overlay, &synced) == -1) {
+                        return -1;
+                }
+                did_action = synced;
+        } else if (by_value) {
+                did_action = do_action_by_value(action, overlay);
+        }
+
+        for (size_t i = 0;
+             i < CONFIG.browsers_num && action != ACTION_RELOAD && !by_value;
+             i++) {
                 struct Browser *browser = CONFIG.browsers[i];
 
+                if (!browser_selected(browser)) {
+                        continue;
+                }
+                selected++;
+
+                if (action == ACTION_RESYNC && lock_cancelled()) {
+                        break;
+                }
+
                 // if a directory or entire browser was not u/r/synced (error)
                 // then skip it and still continue
                 if (do_action_on_browser(browser, action, overlay) == -1) {
@@ -176,40 +358,98 @@ int do_action(enum Action action)
                 }
                 did_action++;
         }
+        if (action == ACTION_RESYNC && lock_cancelled()) {
+                plog(LOG_INFO, "stopped for a more urgent instance");
+                return 0;
+        }
+        // other directories are left alone when only some are unsynced, or
+        // when the deadline passed before all of them were
+        bool still_synced = action == ACTION_UNSYNC &&
+                            (selection_active() || by_value) &&
+                            anything_synced();
 
 #ifndef NOOVERLAY
-        // reset overlay if configured
+        // let the hydrator prefetch the rest
+        finish_hydrator();
+
+        // everything was filled in while resyncing, unless other
+        // directories are still synced
+        if ((action == ACTION_UNSYNC || action == ACTION_DETACH) &&
+            !still_synced && stop_hydrator() == -1) {
+                plog(LOG_WARN, "failed stopping hydrator");
+                PERROR();
+        }
+#endif
+
+#ifndef NOOVERLAY
+        // reset overlay if configured, it's left to resyncs of everything
         if (action == ACTION_RESYNC && overlay && did_action > 0 &&
-            CONFIG.reset_overlay) {
+            CONFIG.reset_overlay && !selection_active()) {
                 if (reset_overlay() == -1) {
                         plog(LOG_ERROR, "failed resetting overlay");
                         return -1;
                 }
         }
 
+        // rolled back backups are only seen after the upper dir is cleared
+        if (action == ACTION_ROLLBACK && overlay && did_action > 0 &&
+            remount_overlay() == -1) {
+                plog(LOG_ERROR, "failed remounting overlay");
+                return -1;
+        }
+
+        // directories added to or removed from the backups are only seen
+        // properly by a new overlay, the standby one takes the upper dirs of
+        // the others over
+        if ((action == ACTION_RELOAD || action == ACTION_SYNC ||
+             (action == ACTION_UNSYNC && still_synced && !by_value)) &&
+            did_action > 0 && overlay && overlay_mounted() &&
+            reset_overlay() == -1) {
+                plog(LOG_ERROR, "failed resetting overlay");
+                return -1;
+        }
+
         // we mount after because modifying lowerdir before mount
-        // doesn't reflect changes
-        if (did_action > 0 && overlay && action == ACTION_SYNC) {
-                if (overlay_mounted()) {
-                        plog(LOG_WARN,
-                             "tmpfs is mounted, cannot mount overlay; please check");
-                } else if (mount_overlay() == -1) {
+        // doesn't reflect changes. when attaching or reloading it's
+        // normally still mounted
+        if (did_action > 0 && overlay && !overlay_mounted() &&
+            (action == ACTION_SYNC || action == ACTION_ATTACH ||
+             action == ACTION_RELOAD)) {
+                if (mount_overlay() == -1) {
                         plog(LOG_ERROR, "failed creating overlay");
                         return -1;
+                } else if (CONFIG.rootless_overlay &&
+                           repoint_dirs("tmpfs") == -1) {
+                        // symlinks were created before the namespace existed
+                        plog(LOG_ERROR, "failed pointing symlinks to overlay");
+                        return -1;
                 }
         }
 
-        if (!overlay && overlay_mounted() && action == ACTION_UNSYNC) {
+        if (!overlay && overlay_mounted() && action == ACTION_UNSYNC &&
+            !still_synced) {
                 plog(LOG_WARN,
                      "tmpfs is mounted, but required capabilities do not exist");
-        } else if (action == ACTION_UNSYNC && overlay_mounted() &&
-                   unmount_overlay() == -1) {
+        } else if (action == ACTION_UNSYNC && !still_synced &&
+                   overlay_mounted() && unmount_overlay() == -1) {
                 plog(LOG_ERROR, "failed removing overlay");
                 return -1;
         }
 #endif
 
-        if (action == ACTION_UNSYNC) {
+        // tmpfs, symlinks and overlay are left for --attach
+        if (action == ACTION_DETACH && did_action > 0 &&
+            write_file(PATHS.detached, "") == -1) {
+                plog(LOG_ERROR, "failed marking as detached");
+                PERROR();
+                return -1;
+        } else if ((action == ACTION_SYNC || action == ACTION_ATTACH) &&
+                   unlink(PATHS.detached) == -1 && errno != ENOENT) {
+                plog(LOG_WARN, "failed removing %s", PATHS.detached);
+                PERROR();
+        }
+
+        if (action == ACTION_UNSYNC && !still_synced) {
                 plog(LOG_INFO, "finding leftover or unknown directories/files");
                 if (log_paths()) {
                         plog(LOG_ERROR, "failed finding unknown paths");
@@ -220,9 +460,214 @@ int do_action(enum Action action)
                 }
         }
 
+        // others coalesce onto a resync of everything
+        if (action == ACTION_RESYNC && !selection_active() && !by_value &&
+            did_action == selected && record_resync() == -1) {
+                plog(LOG_WARN, "failed recording resync");
+                PERROR();
+        }
+
         return 0;
 }
 
+// unsync directories that were removed from bor.conf and sync the ones that
+// were added, compared to the current session. the rest aren't touched
+int reload_dirs(bool overlay, size_t *synced)
+{
+        struct ConfigSkel next;
+        size_t unsynced = 0;
+        bool active = false;
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                active |= browser_synced(CONFIG.browsers[i]);
+        }
+        // .bor.conf was only just made from bor.conf
+        if (!active) {
+                plog(LOG_WARN, "nothing is synced, nothing to reload");
+                return uninit();
+        }
+
+        if (load_new_config(&next) == -1) {
+                plog(LOG_ERROR, "failed parsing config file");
+                free_browsers(&next);
+                return -1;
+        }
+        if (config_options_changed()) {
+                plog(LOG_WARN, "options other than browsers were changed, "
+                               "they are only used after unsyncing");
+        }
+
+        // removed ones first, so that nothing that's synced is left out of
+        // .bor.conf
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+
+                        if (dir_in_config(&next, dir)) {
+                                continue;
+                        }
+                        plog(LOG_INFO, "directory %s was removed", dir->path);
+
+                        if (do_action_on_dir(dir, ACTION_UNSYNC, overlay,
+                                             false) == 0) {
+                                unsynced++;
+                                continue;
+                        }
+                        plog(LOG_ERROR,
+                             "failed unsyncing removed directory %s",
+                             dir->path);
+                        free_browsers(&next);
+
+                        // .bor.conf still has to match what's synced
+                        struct Browser *kept[MAX_BROWSERS];
+                        size_t kept_num = 0;
+
+                        for (size_t j = 0; j < CONFIG.browsers_num; j++) {
+                                if (browser_synced(CONFIG.browsers[j])) {
+                                        kept[kept_num++] = CONFIG.browsers[j];
+                                }
+                        }
+                        if (unsynced > 0 &&
+                            replace_session_browsers(kept, kept_num) == -1) {
+                                plog(LOG_ERROR, "failed saving config of "
+                                                "current session");
+                                PERROR();
+                        }
+                        return -1;
+                }
+        }
+
+        for (size_t i = 0; i < next.browsers_num; i++) {
+                struct Browser *browser = next.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+
+                        if (dir_in_config(&CONFIG, dir)) {
+                                continue;
+                        }
+                        plog(LOG_INFO, "directory %s was added", dir->path);
+
+                        if (do_action_on_dir(dir, ACTION_SYNC, overlay,
+                                             false) == -1) {
+                                plog(LOG_WARN,
+                                     "failed syncing added directory %s",
+                                     dir->path);
+                                continue;
+                        }
+                        (*synced)++;
+                }
+        }
+
+        if (unsynced == 0 && *synced == 0) {
+                plog(LOG_INFO, "no directories were added or removed");
+                free_browsers(&next);
+                return 0;
+        }
+        if (replace_session_browsers(next.browsers, next.browsers_num) ==
+            -1) {
+                plog(LOG_ERROR, "failed saving config of current session");
+                PERROR();
+                return -1;
+        }
+
+        return 0;
+}
+
+// make browsers the ones of the current session and save them to .bor.conf,
+// the replaced ones that aren't among them are freed
+int replace_session_browsers(struct Browser **browsers, size_t browsers_num)
+{
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                bool kept = false;
+
+                for (size_t k = 0; k < browsers_num && !kept; k++) {
+                        kept = (browsers[k] == CONFIG.browsers[i]);
+                }
+                if (!kept) {
+                        free_browser(CONFIG.browsers[i]);
+                }
+        }
+        memmove(CONFIG.browsers, browsers,
+                browsers_num * sizeof(struct Browser *));
+        CONFIG.browsers_num = browsers_num;
+
+        return save_session_config();
+}
+
+void free_browsers(struct ConfigSkel *config)
+{
+        for (size_t i = 0; i < config->browsers_num; i++) {
+                free_browser(config->browsers[i]);
+        }
+        config->browsers_num = 0;
+}
+
+bool browser_synced(struct Browser *browser)
+{
+        struct stat sb;
+
+        for (size_t i = 0; i < browser->dirs_num; i++) {
+                if (SYMEXISTS(browser->dirs[i]->path)) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+// true if any directory is still synced, including those of browsers whose
+// scripts weren't run
+bool anything_synced(void)
+{
+        struct stat sb;
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                for (size_t k = 0; k < CONFIG.browsers[i]->dirs_num; k++) {
+                        if (SYMEXISTS(CONFIG.browsers[i]->dirs[k]->path)) {
+                                return true;
+                        }
+                }
+        }
+#ifndef NOOVERLAY
+        // every browser is loaded when the overlay is used
+        if (overlay_mounted()) {
+                return false;
+        }
+#endif
+        DIR *dp = opendir(PATHS.tmpfs);
+        struct dirent *de = NULL;
+        bool found = false;
+
+        if (dp == NULL) {
+                return false;
+        }
+        while (!found && (de = readdir(dp)) != NULL) {
+                found = !name_is_dot(de->d_name);
+        }
+        closedir(dp);
+
+        return found;
+}
+
+bool dir_in_config(const struct ConfigSkel *config, const struct Dir *dir)
+{
+        for (size_t i = 0; i < config->browsers_num; i++) {
+                struct Browser *browser = config->browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        if (STR_EQUAL(browser->dirs[k]->path, dir->path) &&
+                            browser->dirs[k]->type == dir->type) {
+                                return true;
+                        }
+                }
+        }
+
+        return false;
+}
+
 // initialize paths and config
 // if save_config is true then make a .bor.conf file to save state
 int init(bool save_config)
@@ -236,6 +681,13 @@ int init(bool save_config)
                 plog(LOG_ERROR, "failed initializing config");
                 return -1;
         }
+        init_backup_roots();
+#ifndef NOOVERLAY
+        if (init_overlay() == -1) {
+                plog(LOG_ERROR, "failed initializing overlay");
+                return -1;
+        }
+#endif
 
         return 0;
 }
@@ -254,6 +706,10 @@ int uninit(void)
                 plog(LOG_WARN, "failed removing .bor.conf");
                 PERROR();
         }
+        if (LEXISTS(PATHS.detached) && unlink(PATHS.detached) == -1) {
+                plog(LOG_WARN, "failed removing %s", PATHS.detached);
+                PERROR();
+        }
 
         return 0;
 }
@@ -272,6 +728,10 @@ int check_runtime_space(void)
                 for (size_t k = 0; k < browser->dirs_num; k++) {
                         struct Dir *dir = browser->dirs[k];
 
+                        // only seeded, which takes next to nothing
+                        if (!dir->selected || cache_ephemeral(dir)) {
+                                continue;
+                        }
                         if (stat(dir->path, &sb) == -1 ||
                             !S_ISDIR(sb.st_mode)) {
                                 plog(LOG_WARN,
@@ -279,8 +739,12 @@ int check_runtime_space(void)
                                      dir->path);
                                 continue;
                         }
-
+                        // excluded files aren't copied
+                        if (set_exclude_filter(dir, dir->path) == -1) {
+                                return -1;
+                        }
                         size += get_dir_size(dir->path);
+                        clear_policy_filter();
                 }
         }
         struct statvfs svfsb;
@@ -329,6 +793,50 @@ int clear_recovery_dirs(void)
         return 0;
 }
 
+// copy files saved in recovery dirs that match pattern (all if NULL) back
+// into their directories, newer recovery dirs win
+int restore_recovery_dirs(const char *pattern)
+{
+        if (init(false) == -1) {
+                return -1;
+        }
+        int err = 0;
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+                        glob_t gb;
+
+                        if (get_recovery_dirs(dir, &gb) == -1) {
+                                plog(LOG_WARN, "failed getting directories");
+                                err = -1;
+                                continue;
+                        }
+                        if (gb.gl_pathc > 0 &&
+                            get_pid(browser->procname) >= 0) {
+                                plog(LOG_ERROR,
+                                     "browser %s is running, cannot restore",
+                                     browser->name);
+                                globfree(&gb);
+                                err = -1;
+                                continue;
+                        }
+
+                        for (size_t j = 0; j < gb.gl_pathc; j++) {
+                                if (is_recovery_bundle(gb.gl_pathv[j]) &&
+                                    restore_recovery(dir, gb.gl_pathv[j],
+                                                     pattern) == -1) {
+                                        err = -1;
+                                }
+                        }
+                        globfree(&gb);
+                }
+        }
+        return err;
+}
+
 // remove files/dirs specified in glob struct
 int remove_glob(glob_t *gb)
 {
@@ -353,10 +861,11 @@ int get_recovery_dirs(struct Dir *target_dir, glob_t *glob_struct)
         // use a glob to get recovery dirs
         char pattern[PATH_MAX];
 
-        snprintf(pattern, PATH_MAX, "%s/" BOR_CRASH_PREFIX "*",
-                 target_dir->parent_path);
+        snprintf(pattern, PATH_MAX, "%s/" BOR_CRASH_PREFIX "%s_*",
+                 target_dir->parent_path, target_dir->dirname);
 
-        int err = glob(pattern, GLOB_NOSORT | GLOB_ONLYDIR, NULL, glob_struct);
+        // sorted, oldest first
+        int err = glob(pattern, GLOB_ONLYDIR, NULL, glob_struct);
 
         if (err != 0 && err != GLOB_NOMATCH) {
                 plog(LOG_ERROR, "failed globbing directories");
@@ -420,6 +929,23 @@ void print_help(void)
         printf(" -c, --clean                 remove recovery directories\n");
         printf(" -x, --rm_cache              clear cache directories\n");
         printf(" -p, --status                show current configuration & state\n");
+        printf(" -R, --rollback[=generation] restore backups from their snapshots,\n");
+        printf("                             or from the given generation\n");
+        printf(" -e, --restore[=pattern]     restore files saved in recovery directories\n");
+        printf("                             (only those matching pattern if given)\n");
+        printf(" -d, --detach                resync and leave everything in RAM\n");
+        printf(" -a, --attach                take over what was left by --detach\n");
+        printf(" -l, --reload                sync or unsync browsers added to or\n");
+        printf("                             removed from bor.conf\n");
+        printf(" -b, --browser <name>        only act on this browser (repeatable)\n");
+        printf(" -D, --dir <path>            only act on this directory (repeatable)\n");
+        printf("                             for sync, unsync, resync, rm_cache and status\n");
+        printf(" -B, --background            resync at idle priority and limited\n");
+        printf("                             bandwidth, giving way to any other instance\n");
+        printf(" -t, --deadline <seconds>    resync or unsync what matters most first,\n");
+        printf("                             and stop once seconds have passed\n");
+        printf(" -S, --scheduled             only resync if enough is at risk, or has\n");
+        printf("                             been for long enough\n");
 
 #ifndef NOSYSTEMD
         printf("\nNot recommended to use sync functions directly.\n");
@@ -429,6 +955,8 @@ void print_help(void)
 
 void print_status(void)
 {
+        struct stat sb;
+
         if (init(false) == -1) {
                 return;
         }
@@ -446,6 +974,10 @@ void print_status(void)
                timer_active ? "Active" : "Inactive");
 #endif
 
+        if (FEXISTS(PATHS.detached)) {
+                printf("Detached:                Yes\n");
+        }
+
 #ifndef NOOVERLAY
         printf("Overlay:                 %s\n",
                CONFIG.enable_overlay ? "Enabled" : "Disabled");
@@ -458,6 +990,22 @@ void print_status(void)
                 printf("Total overlay size:      %s\n", otosize);
 
                 free(otosize);
+
+                const char *oopts = get_overlay_opts();
+
+                printf("Overlay options:         %s\n",
+                       oopts[0] != 0 ? oopts : "None");
+
+                if (overlay_lower_is_image()) {
+                        off_t isize = (stat(PATHS.lower_image, &sb) == 0) ?
+                                              sb.st_size :
+                                              0;
+                        char *hisize = human_readable(isize);
+
+                        printf("Overlay lower image:     %s\n", hisize);
+
+                        free(hisize);
+                }
         }
 #endif
         char *tosize = human_readable(get_dir_size(PATHS.tmpfs));
@@ -468,17 +1016,58 @@ void print_status(void)
 
         printf("\nDirectories:\n\n");
 
-        struct stat sb;
         char backup[PATH_MAX], tmpfs[PATH_MAX], otmpfs[PATH_MAX];
 
         for (size_t i = 0; i < CONFIG.browsers_num; i++) {
                 struct Browser *browser = CONFIG.browsers[i];
 
+                if (!browser_selected(browser)) {
+                        continue;
+                }
                 printf("Browser: %s\n", browser->name);
 
+                struct Risk risk = { 0 };
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        if (browser->dirs[k]->selected) {
+                                add_dir_risk(browser->dirs[k], &risk);
+                        }
+                }
+                if (risk.bytes > 0) {
+                        char *rsize = human_readable(risk.bytes);
+
+                        printf("Data at risk:      %s (for %lld seconds)\n",
+                               rsize, (long long)(time(NULL) - risk.flushed));
+                        free(rsize);
+                } else {
+                        printf("Data at risk:      None\n");
+                }
+#ifndef NOOVERLAY
+                // only bor's own merges know, rsync skips unchanged
+                // blocks on its own
+                if (overlay_mounted()) {
+                        off_t avoided = 0;
+
+                        for (size_t k = 0; k < browser->dirs_num; k++) {
+                                if (browser->dirs[k]->selected) {
+                                        avoided += get_writes_avoided(
+                                                browser->dirs[k]);
+                                }
+                        }
+                        char *asize = human_readable(avoided);
+
+                        printf("Writes avoided:    %s (last resync)\n",
+                               asize);
+                        free(asize);
+                }
+#endif
+
                 for (size_t k = 0; k < browser->dirs_num; k++) {
                         struct Dir *dir = browser->dirs[k];
 
+                        if (!dir->selected) {
+                                continue;
+                        }
                         if (get_paths(dir, backup, tmpfs) == -1) {
                                 printf("Error\n");
                                 continue;
@@ -489,6 +1078,8 @@ void print_status(void)
                                                                   "unknown";
 
                         printf("Type:              %s\n", type);
+                        printf("State:             %s\n",
+                               state_str[get_dir_state(dir, backup, tmpfs)]);
                         if (DIREXISTS(dir->path) || SYMEXISTS(dir->path)) {
                                 printf("Directory:         %s\n", dir->path);
                                 dir_exists = true;
@@ -499,14 +1090,22 @@ void print_status(void)
                         if (DIREXISTS(backup)) {
                                 printf("Backup:            %s\n", backup);
                         }
+                        if (backup_is_remote(dir, backup)) {
+                                printf("Warning:           backup is on another "
+                                       "filesystem, it is copied instead of "
+                                       "moved\n");
+                        }
                         if (DIREXISTS(tmpfs)) {
                                 printf("Tmpfs:             %s\n", tmpfs);
                         }
-                        if (dir_exists) {
+                        // without what's excluded, which isn't in RAM
+                        if (dir_exists &&
+                            set_exclude_filter(dir, dir->path) == 0) {
                                 char *size =
                                         human_readable(get_dir_size(dir->path));
                                 printf("Size:              %s\n", size);
                                 free(size);
+                                clear_policy_filter();
                         }
 #ifndef NOOVERLAY
                         if (overlay_mounted()) {
@@ -522,13 +1121,28 @@ void print_status(void)
                                 free(osize);
                         }
 #endif
-                        // print recovery dirs
                         glob_t gb;
 
+                        if (get_generations(backup, &gb) == 0 &&
+                            gb.gl_pathc > 0) {
+                                char *oldest = strrchr(gb.gl_pathv[0], '/'),
+                                     *newest = strrchr(
+                                             gb.gl_pathv[gb.gl_pathc - 1],
+                                             '/');
+
+                                printf("Generations:       %zu (%s to %s)\n",
+                                       gb.gl_pathc, oldest + 1, newest + 1);
+                        }
+                        globfree(&gb);
+
+                        // print recovery dirs
+
                         if (get_recovery_dirs(dir, &gb) == 0) {
                                 for (size_t j = 0; j < gb.gl_pathc; j++) {
                                         printf("Recovery:          %s\n",
                                                gb.gl_pathv[j]);
+                                        print_recovery(gb.gl_pathv[j],
+                                                       "                     ");
                                 }
 
                                 globfree(&gb);
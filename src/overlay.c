@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "overlay.h"
 #include "config.h"
 #include "log.h"
@@ -7,10 +8,133 @@
 #include <sys/mount.h>
 #include <unistd.h>
 #include <sys/vfs.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <sys/ioctl.h>
 #include <linux/magic.h>
+#include <linux/loop.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
 
 #ifndef NOOVERLAY
 
+// state kept while merging the upper dir of a directory.
+// renamed entries still get their contents from where they were in lower,
+// so those places have to stay around for as long as the overlay is used
+struct Merge {
+        char **sources;
+        size_t sources_num;
+        char **removals;
+        size_t removals_num;
+        bool keep_newer;
+        // bytes of unchanged files that weren't rewritten
+        off_t unchanged;
+};
+
+// state kept while compacting the upper dir of a directory
+struct Compaction {
+        const char *upper_root;
+        char root_name[NAME_MAX];
+        char **open_files;
+        size_t open_files_num;
+        size_t staged_num;
+        off_t freed;
+};
+
+static int mount_overlay_caps(const char *data);
+static int mount_overlay_rootless(const char *data);
+static int enter_rootless_ns(void);
+static int unmount_overlay_rootless(void);
+static void get_overlay_data(char *buf, size_t size, const char *lower,
+                             const char *upper, const char *work);
+static bool next_backup_root(char *root, size_t *i);
+static void choose_overlay_opts(void);
+static bool kernel_at_least(int major, int minor);
+static int setup_lower_image(const char *image, const char *mountpoint);
+static int build_lower_image(const char *image);
+static int mount_lower_image(const char *image, const char *mountpoint);
+static int attach_loop_device(const char *image, char *dev, size_t size);
+static int replace_lower_image(void);
+static void remove_lower_image(const char *image, const char *mountpoint);
+static bool dir_has_entries(const char *path);
+static int remove_overlay_dirs(const char *upper, const char *work);
+static int retire_overlay_dirs(void);
+static int run_mount_op(int (*op)(void *arg), void *arg);
+static int join_rootless_ns(pid_t pid);
+static int attach_overlay_op(void *arg);
+static int swap_overlay_op(void *arg);
+static int detach_overlay_op(void *arg);
+static pid_t get_rootless_pid(void);
+static void set_tmpfs_path(pid_t pid);
+static bool check_mounted(void);
+static int merge_entry(struct Merge *m, const char *upper,
+                       const char *merged, const char *lower);
+static int merge_dir_entries(struct Merge *m, const char *upper,
+                             const char *merged, const char *lower);
+static int add_redirect_sources(struct Merge *m, const char *upper,
+                                const char *lower);
+static bool is_redirect_source(struct Merge *m, const char *path);
+static void get_backup_path(char *buf, size_t size, const char *path);
+static int append_path(char ***list, size_t *len, const char *path);
+static bool is_whiteout(const char *path, const struct stat *sb);
+static ssize_t get_ovl_xattr(const char *path, const char *name, char *value,
+                             size_t size);
+static bool has_ovl_xattr(const char *path, const char *name);
+static int compact_dir(struct Compaction *c, const char *upper,
+                       const char *merged, const char *lower);
+static int compact_file(struct Compaction *c, const char *upper,
+                        const char *merged, const char *lower);
+static bool compaction_file_open(struct Compaction *c, const char *upper);
+
+// extra options the overlay was mounted with, on top of the required ones.
+// these are recorded in the runtime dir so that later runs know about them
+static char overlay_opts[100] = { 0 };
+static bool metacopy_on = false;
+
+// whether the overlay is mounted, -1 if it has to be checked again
+static int mounted = -1;
+
+// see merge_writes_avoided()
+static off_t last_unchanged = 0;
+
+// device of the overlay replaced by swap_standby_overlay()
+static dev_t swapped_dev = 0;
+
+// should be run after config has been initialized;
+// if a rootless overlay is being held, then make tmpfs point into it
+int init_overlay(void)
+{
+        struct stat sb;
+
+        if (FEXISTS(PATHS.lower_image)) {
+                snprintf(PATHS.overlay_lower, PATH_MAX, "%s",
+                         PATHS.lower_mountpoint);
+        }
+        FILE *fp = fopen(PATHS.overlay_opts, "r");
+
+        if (fp != NULL) {
+                if (fgets(overlay_opts, sizeof(overlay_opts), fp) == NULL) {
+                        overlay_opts[0] = 0;
+                }
+                fclose(fp);
+                overlay_opts[strcspn(overlay_opts, "\n")] = 0;
+                metacopy_on = (strstr(overlay_opts, "metacopy=on") != NULL);
+        }
+
+        if (!CONFIG.rootless_overlay) {
+                return 0;
+        }
+        set_tmpfs_path(get_rootless_pid());
+
+        return 0;
+}
+
 // creates overlay mounted on tmpfs
 // does not check enable_overlay config option or if we have required caps
 int mount_overlay(void)
@@ -35,39 +159,554 @@ int mount_overlay(void)
                 return -1;
         }
 
-        unsigned long mountflags = MS_NOSUID | MS_NODEV | MS_NOATIME;
-        char data[PATH_MAX * 2 + 100];
+        snprintf(PATHS.overlay_lower, PATH_MAX, "%s", PATHS.backups);
+
+        if (CONFIG.overlay_lower != LOWER_DISK) {
+                if (CONFIG.rootless_overlay) {
+                        // neither can be mounted in a user namespace
+                        plog(LOG_WARN, "overlay_lower cannot be used with "
+                                       "rootless_overlay, using backups");
+                } else if (setup_lower_image(PATHS.lower_image,
+                                             PATHS.lower_mountpoint) == -1) {
+                        plog(LOG_WARN, "failed creating lower image, "
+                                       "using backups");
+                } else {
+                        snprintf(PATHS.overlay_lower, PATH_MAX, "%s",
+                                 PATHS.lower_mountpoint);
+                }
+        }
+        char data[PATH_MAX * 5 + 200];
+
+        choose_overlay_opts();
+        get_overlay_data(data, sizeof(data), PATHS.overlay_lower,
+                         PATHS.overlay_upper, PATHS.overlay_work);
+
+        int err = (CONFIG.rootless_overlay) ? mount_overlay_rootless(data) :
+                                              mount_overlay_caps(data);
+
+        mounted = -1;
+
+        // probing isn't perfect, so try again with just the required options
+        if (err == -1 && errno == EINVAL && overlay_opts[0] != 0) {
+                plog(LOG_WARN, "overlay does not accept options %s, "
+                               "mounting without them",
+                     overlay_opts);
+                overlay_opts[0] = 0;
+                metacopy_on = false;
+                get_overlay_data(data, sizeof(data), PATHS.overlay_lower,
+                                 PATHS.overlay_upper, PATHS.overlay_work);
+                err = (CONFIG.rootless_overlay) ? mount_overlay_rootless(data) :
+                                                  mount_overlay_caps(data);
+        }
+
+        if (err == -1) {
+                plog(LOG_ERROR, "failed mounting overlay");
+                PERROR();
+                if (overlay_lower_is_image()) {
+                        remove_lower_image(PATHS.lower_image,
+                                           PATHS.lower_mountpoint);
+                        snprintf(PATHS.overlay_lower, PATH_MAX, "%s",
+                                 PATHS.backups);
+                }
+                return -1;
+        }
+
+        if (write_file(PATHS.overlay_opts, overlay_opts) == -1) {
+                plog(LOG_WARN, "failed saving overlay options");
+                PERROR();
+        }
+
+        return 0;
+}
+
+// write mount options for an overlay using given lower, upper and work dirs
+static void get_overlay_data(char *buf, size_t size, const char *lower,
+                             const char *upper, const char *work)
+{
+        // backups of dirs on other filesystems are in their own roots,
+        // which are stacked below the main one
+        char lowers[PATH_MAX * 2];
+        size_t len = (size_t)snprintf(lowers, sizeof(lowers), "%s", lower);
+        char root[PATH_MAX];
+
+        for (size_t i = 0; next_backup_root(root, &i);) {
+                struct stat sb;
+
+                if (DIREXISTS(root) && len < sizeof(lowers)) {
+                        len += snprintf(lowers + len, sizeof(lowers) - len,
+                                        ":%s", root);
+                }
+        }
+
+        // unprivileged overlays cannot use trusted.* xattrs
+        snprintf(buf, size,
+                 "index=off,lowerdir=%s,upperdir=%s,workdir=%s%s%s%s",
+                 lowers, upper, work,
+                 CONFIG.rootless_overlay ? ",userxattr" : "",
+                 overlay_opts[0] != 0 ? "," : "", overlay_opts);
+}
+
+// copy the backup root at position *i in PATHS.backup_roots into root,
+// and advance *i past it
+static bool next_backup_root(char *root, size_t *i)
+{
+        const char *p = PATHS.backup_roots + *i;
+        size_t len = strcspn(p, ":");
+
+        if (len == 0) {
+                return false;
+        }
+        snprintf(root, PATH_MAX, "%.*s", (int)len, p);
+        *i += len + (p[len] == ':');
+
+        return true;
+}
+
+// pick extra mount options based on config and what the kernel supports.
+// metacopy only copies up metadata on chmod, chown and such, the data is
+// copied up once it's actually written to; it requires redirect_dir.
+// volatile skips syncing the upper dir, which is on a tmpfs anyways.
+static void choose_overlay_opts(void)
+{
+        overlay_opts[0] = 0;
+        metacopy_on = false;
+
+        if (CONFIG.overlay_metacopy) {
+                struct stat sb;
+
+                if (CONFIG.rootless_overlay) {
+                        // the kernel refuses metacopy with userxattr, since
+                        // user xattrs can be forged
+                        plog(LOG_WARN, "overlay_metacopy cannot be used with "
+                                       "rootless_overlay, ignoring");
+                } else if (!kernel_at_least(4, 19) &&
+                           !FEXISTS("/sys/module/overlay/parameters/"
+                                    "metacopy")) {
+                        plog(LOG_WARN, "overlay_metacopy requires Linux 4.19 "
+                                       "or newer, ignoring");
+                } else {
+                        snprintf(overlay_opts, sizeof(overlay_opts),
+                                 "redirect_dir=on,metacopy=on");
+                        metacopy_on = true;
+                }
+        }
+        if (CONFIG.overlay_volatile) {
+                if (!kernel_at_least(5, 10)) {
+                        plog(LOG_WARN, "overlay_volatile requires Linux 5.10 "
+                                       "or newer, ignoring");
+                } else {
+                        size_t len = strlen(overlay_opts);
+
+                        snprintf(overlay_opts + len, sizeof(overlay_opts) - len,
+                                 "%svolatile", len > 0 ? "," : "");
+                }
+        }
+        if (overlay_opts[0] != 0) {
+                plog(LOG_DEBUG, "using overlay options %s", overlay_opts);
+        }
+}
+
+static bool kernel_at_least(int major, int minor)
+{
+        struct utsname un;
+        int kmajor = 0, kminor = 0;
+
+        if (uname(&un) == -1 ||
+            sscanf(un.release, "%d.%d", &kmajor, &kminor) != 2) {
+                return false;
+        }
+
+        return kmajor > major || (kmajor == major && kminor >= minor);
+}
+
+// return the extra options the overlay was mounted with, empty if none
+const char *get_overlay_opts(void)
+{
+        return overlay_opts;
+}
+
+// check if the lower layer is a compressed image of the backups instead of
+// the backups themselves; the image is stored in the runtime dir, so all of
+// it is in RAM.
+bool overlay_lower_is_image(void)
+{
+        return !STR_EQUAL(PATHS.overlay_lower, PATHS.backups);
+}
+
+static int setup_lower_image(const char *image, const char *mountpoint)
+{
+        plog(LOG_INFO, "creating %s image of backups",
+             CONFIG.overlay_lower == LOWER_EROFS ? "erofs" : "squashfs");
+
+        if (create_dir(mountpoint, 0755) == -1 ||
+            build_lower_image(image) == -1 ||
+            mount_lower_image(image, mountpoint) == -1) {
+                PERROR();
+                remove_lower_image(image, mountpoint);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int build_lower_image(const char *image)
+{
+        char *cmdline = NULL;
+        int err = 0;
+
+        // output isn't read, so don't let it fill up the pipe
+        if (CONFIG.overlay_lower == LOWER_EROFS) {
+                err = asprintf(&cmdline,
+                               "mkfs.erofs -zlz4hc --quiet '%s' '%s' "
+                               ">/dev/null",
+                               image, PATHS.backups);
+        } else {
+                err = asprintf(&cmdline,
+                               "mksquashfs '%s' '%s' -noappend -quiet "
+                               "-no-progress >/dev/null",
+                               PATHS.backups, image);
+        }
+        if (err == -1) {
+                return -1;
+        }
+        FILE *cmdp = popen(cmdline, "r");
+
+        free(cmdline);
+
+        if (cmdp == NULL || pclose(cmdp) != 0) {
+                unlink(image);
+                return -1;
+        }
 
-        snprintf(data, sizeof(data),
-                 "index=off,lowerdir=%s,upperdir=%s,workdir=%s", PATHS.backups,
-                 PATHS.overlay_upper, PATHS.overlay_work);
+        return 0;
+}
+
+static int mount_lower_image(const char *image, const char *mountpoint)
+{
+        unsigned long mountflags = MS_RDONLY | MS_NOSUID | MS_NODEV;
+        const char *fstype =
+                (CONFIG.overlay_lower == LOWER_EROFS) ? "erofs" : "squashfs";
+        char loopdev[PATH_MAX];
+        int err = -1;
 
         // elevate permissions
         set_caps(CAP_EFFECTIVE, CAP_SET, 2, CAP_SYS_ADMIN, CAP_DAC_OVERRIDE);
 
-        int err = mount("overlay", PATHS.tmpfs, "overlay", mountflags, data);
+        // erofs can be mounted straight from a file since Linux 6.12
+        if (CONFIG.overlay_lower == LOWER_EROFS) {
+                err = mount(image, mountpoint, fstype, mountflags, NULL);
+        }
+        if (err == -1) {
+                int loopfd = attach_loop_device(image, loopdev,
+                                                sizeof(loopdev));
+
+                if (loopfd != -1) {
+                        err = mount(loopdev, mountpoint, fstype, mountflags,
+                                    NULL);
+
+                        // the loop device is cleared once nothing uses it
+                        int prev_errno = errno;
+
+                        close(loopfd);
+                        errno = prev_errno;
+                }
+        }
+        int prev_errno = errno;
 
         // drop permissions
         set_caps(CAP_EFFECTIVE, CAP_CLEAR, 2, CAP_SYS_ADMIN, CAP_DAC_OVERRIDE);
 
+        errno = prev_errno;
+
+        return err;
+}
+
+// attach image to a free loop device, and return an fd of the device
+static int attach_loop_device(const char *image, char *dev, size_t size)
+{
+        int ctlfd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+
+        if (ctlfd == -1) {
+                return -1;
+        }
+        int filefd = open(image, O_RDONLY | O_CLOEXEC), loopfd = -1;
+
+        // something else may grab the same device before us, so try again
+        for (int i = 0; i < 5 && filefd != -1 && loopfd == -1; i++) {
+                int num = ioctl(ctlfd, LOOP_CTL_GET_FREE);
+
+                if (num == -1) {
+                        break;
+                }
+                snprintf(dev, size, "/dev/loop%d", num);
+
+                if ((loopfd = open(dev, O_RDONLY | O_CLOEXEC)) == -1) {
+                        break;
+                }
+                struct loop_config config = {
+                        .fd = (__u32)filefd,
+                        .info.lo_flags = LO_FLAGS_READ_ONLY |
+                                         LO_FLAGS_AUTOCLEAR,
+                };
+
+                if (ioctl(loopfd, LOOP_CONFIGURE, &config) == -1) {
+                        bool busy = (errno == EBUSY);
+
+                        close(loopfd);
+                        loopfd = -1;
+
+                        if (!busy) {
+                                break;
+                        }
+                }
+        }
+        int prev_errno = errno;
+
+        if (filefd != -1) {
+                close(filefd);
+        }
+        close(ctlfd);
+        errno = prev_errno;
+
+        return loopfd;
+}
+
+// put the lower image of the standby overlay in place of the current one.
+// overlays use their own private copy of lower mounts, so it doesn't matter
+// to them that these are moved around.
+static int replace_lower_image(void)
+{
+        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
+
+        int err = umount2(PATHS.lower_mountpoint, MNT_DETACH | UMOUNT_NOFOLLOW);
+
+        if (err == 0) {
+                err = mount(PATHS.standby_lower_mountpoint,
+                            PATHS.lower_mountpoint, NULL, MS_MOVE, NULL);
+        }
+        int prev_errno = errno;
+
+        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+
         if (err == -1) {
-                plog(LOG_ERROR, "failed mounting overlay");
+                errno = prev_errno;
+                return -1;
+        }
+        rmdir(PATHS.standby_lower_mountpoint);
+
+        return rename(PATHS.standby_lower_image, PATHS.lower_image);
+}
+
+static void remove_lower_image(const char *image, const char *mountpoint)
+{
+        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
+
+        // EINVAL means it isn't mounted
+        if (umount2(mountpoint, MNT_DETACH | UMOUNT_NOFOLLOW) == -1 &&
+            errno != EINVAL && errno != ENOENT) {
+                plog(LOG_WARN, "failed unmounting %s", mountpoint);
                 PERROR();
+        }
+
+        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+
+        rmdir(mountpoint);
+        unlink(image);
+}
+
+static bool dir_has_entries(const char *path)
+{
+        DIR *dp = opendir(path);
+        struct dirent *de = NULL;
+        bool found = false;
+
+        if (dp == NULL) {
+                return false;
+        }
+        while (!found && (de = readdir(dp)) != NULL) {
+                found = !name_is_dot(de->d_name);
+        }
+        closedir(dp);
+
+        return found;
+}
+
+static int mount_overlay_caps(const char *data)
+{
+        unsigned long mountflags = MS_NOSUID | MS_NODEV | MS_NOATIME;
+
+        // elevate permissions
+        set_caps(CAP_EFFECTIVE, CAP_SET, 2, CAP_SYS_ADMIN, CAP_DAC_OVERRIDE);
+
+        int err = mount("overlay", PATHS.mountpoint, "overlay", mountflags,
+                        data);
+
+        // drop permissions
+        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 2, CAP_SYS_ADMIN, CAP_DAC_OVERRIDE);
+
+        return err;
+}
+
+// fork off a process that unshares a user and mount namespace, mounts the
+// overlay inside it and then sleeps forever in order to keep the mount alive.
+// other processes reach the overlay through /proc/<pid>/root, which resolves
+// paths inside the mount namespace of that process.
+static int mount_overlay_rootless(const char *data)
+{
+        if (get_rootless_pid() != -1) {
+                plog(LOG_ERROR, "rootless overlay is already running");
+                return -1;
+        }
+        int fds[2];
+
+        if (pipe(fds) == -1) {
+                return -1;
+        }
+
+        pid_t pid = fork();
+
+        if (pid == -1) {
+                close(fds[0]);
+                close(fds[1]);
+                return -1;
+        }
+        if (pid == 0) {
+                unsigned long mountflags = MS_NOSUID | MS_NODEV | MS_NOATIME;
+                char status = 0;
+
+                close(fds[0]);
+
+                if (enter_rootless_ns() == -1 ||
+                    mount("overlay", PATHS.mountpoint, "overlay", mountflags,
+                          data) == -1) {
+                        status = (char)errno;
+                }
+                if (write(fds[1], &status, 1) != 1 || status != 0) {
+                        _exit(1);
+                }
+                close(fds[1]);
+
+                // detach from the session so that we outlive it
+                int nullfd = open("/dev/null", O_RDWR);
+
+                if (nullfd != -1) {
+                        dup2(nullfd, STDIN_FILENO);
+                        dup2(nullfd, STDOUT_FILENO);
+                        dup2(nullfd, STDERR_FILENO);
+                        close(nullfd);
+                }
+                setsid();
+                if (chdir("/") == -1) {
+                        _exit(1);
+                }
+
+                for (;;) {
+                        pause();
+                }
+        }
+        close(fds[1]);
+
+        char status = 1;
+        ssize_t r = read(fds[0], &status, 1);
+
+        close(fds[0]);
+
+        if (r != 1 || status != 0) {
+                waitpid(pid, NULL, 0);
+                errno = (r == 1) ? status : 0;
+                plog(LOG_ERROR, "rootless overlay requires Linux 5.11 or newer "
+                                "and unprivileged user namespaces");
+                return -1;
+        }
+
+        char pidstr[50];
+
+        snprintf(pidstr, sizeof(pidstr), "%d\n", pid);
+
+        if (write_file(PATHS.overlay_pid, pidstr) == -1) {
+                plog(LOG_ERROR, "failed saving pid of rootless overlay");
+                kill(pid, SIGTERM);
                 return -1;
         }
+        set_tmpfs_path(pid);
 
         return 0;
 }
 
+// move into a new user namespace where we are mapped to ourselves,
+// along with a new mount namespace owned by it
+static int enter_rootless_ns(void)
+{
+        char map[100];
+        uid_t uid = getuid();
+        gid_t gid = getgid();
+
+        if (unshare(CLONE_NEWUSER | CLONE_NEWNS) == -1) {
+                return -1;
+        }
+
+        if (write_file("/proc/self/setgroups", "deny") == -1) {
+                return -1;
+        }
+        snprintf(map, sizeof(map), "%d %d 1", uid, uid);
+        if (write_file("/proc/self/uid_map", map) == -1) {
+                return -1;
+        }
+        snprintf(map, sizeof(map), "%d %d 1", gid, gid);
+        if (write_file("/proc/self/gid_map", map) == -1) {
+                return -1;
+        }
+
+        // don't let anything propagate back
+        if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// return pid of the process holding the rootless overlay, or -1 if
+// there is none (or it isn't actually us)
+static pid_t get_rootless_pid(void)
+{
+        return read_pid_file(PATHS.overlay_pid);
+}
+
+// tmpfs is the path that the overlay is reached from, which is
+// the mountpoint itself unless we are rootless
+static void set_tmpfs_path(pid_t pid)
+{
+        mounted = -1;
+
+        if (pid == -1) {
+                snprintf(PATHS.tmpfs, PATH_MAX, "%s", PATHS.mountpoint);
+                snprintf(PATHS.standby_tmpfs, PATH_MAX, "%s",
+                         PATHS.standby_mountpoint);
+        } else {
+                snprintf(PATHS.tmpfs, PATH_MAX, "/proc/%d/root%s", pid,
+                         PATHS.mountpoint);
+                snprintf(PATHS.standby_tmpfs, PATH_MAX, "/proc/%d/root%s",
+                         pid, PATHS.standby_mountpoint);
+        }
+}
+
 int unmount_overlay(void)
 {
         plog(LOG_INFO, "unmounting overlay");
 
-        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
+        struct stat sb;
+        int err = 0;
 
-        int err = umount2(PATHS.tmpfs, MNT_DETACH | UMOUNT_NOFOLLOW);
+        if (CONFIG.rootless_overlay) {
+                err = unmount_overlay_rootless();
+        } else {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
 
-        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+                err = umount2(PATHS.mountpoint, MNT_DETACH | UMOUNT_NOFOLLOW);
+
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+        }
+        mounted = -1;
 
         if (err == -1) {
                 plog(LOG_ERROR, "failed unmounting overlay");
@@ -81,14 +720,21 @@ int unmount_overlay(void)
                 return -1;
         }
 
-        // delete required dirs
-        err = remove_path(PATHS.overlay_upper);
+        if (DIREXISTS(PATHS.overlay_trash) &&
+            remove_path(PATHS.overlay_trash) == -1) {
+                plog(LOG_WARN, "could not delete %s", PATHS.overlay_trash);
+        }
 
-        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
-        err = remove_path(PATHS.overlay_work); // work dir is owned by root
-        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_DAC_OVERRIDE);
+        unlink(PATHS.overlay_opts);
 
-        if (err == -1) {
+        if (overlay_lower_is_image()) {
+                remove_lower_image(PATHS.lower_image, PATHS.lower_mountpoint);
+                snprintf(PATHS.overlay_lower, PATH_MAX, "%s", PATHS.backups);
+        }
+
+        // delete required dirs
+        if (remove_overlay_dirs(PATHS.overlay_upper, PATHS.overlay_work) ==
+            -1) {
                 plog(LOG_WARN, "could not delete leftover directories");
                 PERROR();
                 return -1;
@@ -97,33 +743,980 @@ int unmount_overlay(void)
         return 0;
 }
 
-// check if overlay is mounted
-bool overlay_mounted(void)
+static int remove_overlay_dirs(const char *upper, const char *work)
 {
-        struct stat sb, sb2;
+        int err = remove_path(upper);
 
-        if (stat(PATHS.runtime, &sb) == -1 || stat(PATHS.tmpfs, &sb2) == -1) {
-                return false;
+        if (CONFIG.rootless_overlay) {
+                err = remove_path(work);
+        } else {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
+                err = remove_path(work); // work dir is owned by root
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_DAC_OVERRIDE);
         }
 
-        // check if runtime and tmpfs are on different devices
-        if (sb.st_dev == sb2.st_dev) {
-                // same filesystem
-                return false;
+        return err;
+}
+
+// mount a second overlay with a fresh upper dir beside the current one,
+// so that symlinks can be switched over to it without any downtime.
+// uses the new mount api so that nothing is visible until it's attached.
+int mount_standby_overlay(void)
+{
+        plog(LOG_INFO, "mounting standby overlay");
+
+        if (create_dir(PATHS.standby_upper, 0755) == -1 ||
+            create_dir(PATHS.standby_work, 0755) == -1 ||
+            create_dir(PATHS.standby_mountpoint, 0755) == -1) {
+                plog(LOG_ERROR, "cannot create required directories");
+                PERROR();
+                return -1;
         }
-        struct statfs sfsb;
+        const char *lower = PATHS.overlay_lower;
 
-        if (statfs(PATHS.tmpfs, &sfsb) == -1) {
-                plog(LOG_WARN, "failed getting info about tmpfs");
-                return true;
+        // the image doesn't have anything that was merged into the backups
+        // since it was made, so make a new one if anything was
+        if (overlay_lower_is_image() && dir_has_entries(PATHS.overlay_upper)) {
+                if (setup_lower_image(PATHS.standby_lower_image,
+                                      PATHS.standby_lower_mountpoint) == -1) {
+                        plog(LOG_ERROR, "failed creating new lower image");
+                        remove_overlay_dirs(PATHS.standby_upper,
+                                            PATHS.standby_work);
+                        return -1;
+                }
+                lower = PATHS.standby_lower_mountpoint;
         }
-        // warn if overlay is not actually an overlay mount
-        if (sfsb.f_type != OVERLAYFS_SUPER_MAGIC) {
-                plog(LOG_WARN, "tmpfs is mounted on a different filesytem "
-                               "which is not an overlay filesystem");
+        char data[PATH_MAX * 5 + 200];
+
+        // same options as the current overlay, so that merging its upper
+        // dir works as expected
+        get_overlay_data(data, sizeof(data), lower, PATHS.standby_upper,
+                         PATHS.standby_work);
+
+        if (run_mount_op(attach_overlay_op, data) == -1) {
+                plog(LOG_ERROR, "failed mounting standby overlay");
+                PERROR();
+                remove_overlay_dirs(PATHS.standby_upper, PATHS.standby_work);
+                remove_lower_image(PATHS.standby_lower_image,
+                                   PATHS.standby_lower_mountpoint);
+                return -1;
         }
 
-        return true;
+        return 0;
+}
+
+// replace the current overlay with the standby one; the standby stays
+// attached so that symlinks pointing to it still work
+int swap_standby_overlay(void)
+{
+        struct stat sb;
+
+        plog(LOG_INFO, "replacing overlay with standby overlay");
+
+        // files still open on the old overlay are found by its device
+        swapped_dev = (stat(PATHS.tmpfs, &sb) == 0) ? sb.st_dev : 0;
+
+        if (run_mount_op(swap_overlay_op, NULL) == -1) {
+                plog(LOG_ERROR, "failed replacing overlay");
+                PERROR();
+                return -1;
+        }
+
+        return 0;
+}
+
+// detach the standby mountpoint (should be done after swapping) and
+// reclaim the upper dir of the old overlay, or retire it while files are
+// still open on it
+int release_standby_overlay(void)
+{
+        plog(LOG_INFO, "releasing standby overlay");
+
+        if (run_mount_op(detach_overlay_op, PATHS.standby_mountpoint) == -1) {
+                plog(LOG_ERROR, "failed detaching standby overlay");
+                PERROR();
+                return -1;
+        }
+        rmdir(PATHS.standby_mountpoint);
+
+        if (retire_overlay_dirs() == -1) {
+                plog(LOG_WARN, "could not delete old upper/work directories");
+                PERROR();
+                return -1;
+        }
+
+        // overlay doesn't care if its upper/work dirs are renamed
+        if (rename(PATHS.standby_upper, PATHS.overlay_upper) == -1 ||
+            rename(PATHS.standby_work, PATHS.overlay_work) == -1) {
+                plog(LOG_ERROR, "failed moving standby upper/work directories");
+                PERROR();
+                return -1;
+        }
+        struct stat sb;
+
+        if (FEXISTS(PATHS.standby_lower_image) && replace_lower_image() == -1) {
+                plog(LOG_ERROR, "failed replacing lower image");
+                PERROR();
+                return -1;
+        }
+
+        return 0;
+}
+
+// browsers keep writing to files they had open on the old overlay, which
+// end up in its upper dir. it's kept in a dir named after the device of the
+// overlay until they're closed, and then merged again (see reclaim_overlays())
+static int retire_overlay_dirs(void)
+{
+        if (swapped_dev == 0 || !files_open_on(swapped_dev)) {
+                return remove_overlay_dirs(PATHS.overlay_upper,
+                                           PATHS.overlay_work);
+        }
+        char retired[PATH_MAX], upper[PATH_MAX], work[PATH_MAX];
+
+        snprintf(retired, PATH_MAX, "%s/%lu", PATHS.overlay_retired,
+                 (unsigned long)swapped_dev);
+        snprintf(upper, PATH_MAX, "%s/upper", retired);
+        snprintf(work, PATH_MAX, "%s/work", retired);
+
+        plog(LOG_INFO, "keeping upper dir of old overlay until the files open "
+                       "on it are closed");
+
+        if (create_dir(retired, 0700) == -1 ||
+            rename(PATHS.overlay_upper, upper) == -1) {
+                return -1;
+        }
+        int err = 0;
+
+        // moving a dir elsewhere needs write access to it, and work dir is
+        // owned by root
+        if (CONFIG.rootless_overlay) {
+                err = rename(PATHS.overlay_work, work);
+        } else {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_DAC_OVERRIDE);
+                err = rename(PATHS.overlay_work, work);
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_DAC_OVERRIDE);
+        }
+
+        return err;
+}
+
+// true if files are still open on the old overlay retired is of
+bool retired_overlay_in_use(const char *retired)
+{
+        const char *bn = strrchr(retired, '/');
+        char *end = NULL;
+        unsigned long dev = strtoul((bn == NULL) ? retired : bn + 1, &end, 10);
+
+        return *end == 0 && files_open_on((dev_t)dev);
+}
+
+int remove_retired_overlay(const char *retired)
+{
+        char upper[PATH_MAX], work[PATH_MAX];
+
+        snprintf(upper, PATH_MAX, "%s/upper", retired);
+        snprintf(work, PATH_MAX, "%s/work", retired);
+
+        if (remove_overlay_dirs(upper, work) == -1) {
+                return -1;
+        }
+
+        return rmdir(retired);
+}
+
+// run mount operation with required permissions, which means
+// inside the namespace of the rootless overlay if we are rootless
+static int run_mount_op(int (*op)(void *arg), void *arg)
+{
+        if (!CONFIG.rootless_overlay) {
+                set_caps(CAP_EFFECTIVE, CAP_SET, 2, CAP_SYS_ADMIN,
+                         CAP_DAC_OVERRIDE);
+
+                int err = op(arg);
+                int prev_errno = errno;
+
+                set_caps(CAP_EFFECTIVE, CAP_CLEAR, 2, CAP_SYS_ADMIN,
+                         CAP_DAC_OVERRIDE);
+                errno = prev_errno;
+
+                return err;
+        }
+        pid_t holder = get_rootless_pid();
+
+        if (holder == -1) {
+                errno = ESRCH;
+                return -1;
+        }
+
+        // joining a namespace can't be undone, so do it in a child
+        pid_t pid = fork();
+
+        if (pid == -1) {
+                return -1;
+        }
+        if (pid == 0) {
+                if (join_rootless_ns(holder) == -1 || op(arg) == -1) {
+                        _exit((errno == 0) ? EIO : errno);
+                }
+                _exit(0);
+        }
+        int status = 0;
+
+        if (waitpid(pid, &status, 0) == -1) {
+                return -1;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                errno = WIFEXITED(status) ? WEXITSTATUS(status) : EINTR;
+                return -1;
+        }
+
+        return 0;
+}
+
+static int join_rootless_ns(pid_t pid)
+{
+        char path[PATH_MAX];
+        int userfd, mntfd;
+
+        snprintf(path, PATH_MAX, "/proc/%d/ns/user", pid);
+        userfd = open(path, O_RDONLY | O_CLOEXEC);
+        snprintf(path, PATH_MAX, "/proc/%d/ns/mnt", pid);
+        mntfd = open(path, O_RDONLY | O_CLOEXEC);
+
+        int err = 0;
+
+        if (userfd == -1 || mntfd == -1 || setns(userfd, CLONE_NEWUSER) == -1 ||
+            setns(mntfd, CLONE_NEWNS) == -1) {
+                err = -1;
+        }
+        int prev_errno = errno;
+
+        if (userfd != -1) {
+                close(userfd);
+        }
+        if (mntfd != -1) {
+                close(mntfd);
+        }
+        errno = prev_errno;
+
+        return err;
+}
+
+// create overlay with given options and attach it to the standby mountpoint
+static int attach_overlay_op(void *arg)
+{
+        char *data = strdup(arg);
+        int fsfd = fsopen("overlay", FSOPEN_CLOEXEC), mntfd = -1;
+        int err = 0, prev_errno = 0;
+
+        if (data == NULL || fsfd == -1) {
+                err = -1;
+                goto exit;
+        }
+
+        // options are in the same format as for mount (2)
+        char *saveptr = NULL;
+
+        for (char *opt = strtok_r(data, ",", &saveptr); opt != NULL;
+             opt = strtok_r(NULL, ",", &saveptr)) {
+                char *value = strchr(opt, '=');
+                int r = 0;
+
+                if (value == NULL) {
+                        r = fsconfig(fsfd, FSCONFIG_SET_FLAG, opt, NULL, 0);
+                } else {
+                        *value++ = 0;
+                        r = fsconfig(fsfd, FSCONFIG_SET_STRING, opt, value, 0);
+                }
+                if (r == -1) {
+                        err = -1;
+                        goto exit;
+                }
+        }
+
+        if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1) {
+                err = -1;
+                goto exit;
+        }
+        mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC,
+                        MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV |
+                                MOUNT_ATTR_NOATIME);
+
+        if (mntfd == -1 || move_mount(mntfd, "", AT_FDCWD,
+                                      PATHS.standby_mountpoint,
+                                      MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+                err = -1;
+                goto exit;
+        }
+
+exit:
+        prev_errno = errno;
+
+        if (fsfd != -1) {
+                close(fsfd);
+        }
+        if (mntfd != -1) {
+                close(mntfd);
+        }
+        free(data);
+        errno = prev_errno;
+
+        return err;
+}
+
+// detach the current overlay and attach a clone of the standby in its place
+static int swap_overlay_op(void *UNUSED(arg))
+{
+        int treefd = open_tree(AT_FDCWD, PATHS.standby_mountpoint,
+                               OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+
+        if (treefd == -1) {
+                return -1;
+        }
+        int err = 0;
+
+        if (umount2(PATHS.mountpoint, MNT_DETACH | UMOUNT_NOFOLLOW) == -1 ||
+            move_mount(treefd, "", AT_FDCWD, PATHS.mountpoint,
+                       MOVE_MOUNT_F_EMPTY_PATH) == -1) {
+                err = -1;
+        }
+        int prev_errno = errno;
+
+        close(treefd);
+        errno = prev_errno;
+
+        return err;
+}
+
+static int detach_overlay_op(void *arg)
+{
+        return umount2(arg, MNT_DETACH | UMOUNT_NOFOLLOW);
+}
+
+// kill the process holding the namespace, which makes the
+// mount go away along with it
+static int unmount_overlay_rootless(void)
+{
+        pid_t pid = get_rootless_pid();
+
+        if (pid == -1) {
+                errno = ESRCH;
+                return -1;
+        }
+        if (kill(pid, SIGTERM) == -1) {
+                return -1;
+        }
+
+        // wait at most 5 seconds for it to exit
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000 };
+
+        for (int i = 0; i < 500 && kill(pid, 0) == 0; i++) {
+                nanosleep(&ts, NULL);
+        }
+        if (kill(pid, 0) == 0) {
+                errno = EBUSY;
+                return -1;
+        }
+        unlink(PATHS.overlay_pid);
+        set_tmpfs_path(-1);
+
+        return 0;
+}
+
+// check if overlay is mounted, only checked again after we (un)mount it
+bool overlay_mounted(void)
+{
+        if (mounted == -1) {
+                mounted = check_mounted();
+        }
+
+        return mounted;
+}
+
+static bool check_mounted(void)
+{
+        struct stat sb, sb2;
+
+        if (stat(PATHS.runtime, &sb) == -1 || stat(PATHS.tmpfs, &sb2) == -1) {
+                return false;
+        }
+
+        // check if runtime and tmpfs are on different devices
+        if (sb.st_dev == sb2.st_dev) {
+                // same filesystem
+                return false;
+        }
+        struct statfs sfsb;
+
+        if (statfs(PATHS.tmpfs, &sfsb) == -1) {
+                plog(LOG_WARN, "failed getting info about tmpfs");
+                return true;
+        }
+        // warn if overlay is not actually an overlay mount
+        if (sfsb.f_type != OVERLAYFS_SUPER_MAGIC) {
+                plog(LOG_WARN, "tmpfs is mounted on a different filesytem "
+                               "which is not an overlay filesystem");
+        }
+
+        return true;
+}
+
+// apply changes stored in the upper dir of the overlay onto lower,
+// merged is the same directory as seen through the overlay and is used for
+// data that upper doesn't hold. only upper is walked, so the cost is
+// proportional to what has changed.
+//
+// deletions are done last, and places in lower that renamed entries still
+// refer to are only deleted with MERGE_FINAL, i.e. this overlay won't be used
+// for this directory anymore. otherwise they would vanish from the overlay.
+//
+// with MERGE_KEEP_NEWER, entries in lower that were changed after their
+// counterpart in upper are left alone, which is for merging into another
+// overlay that is already in use.
+//
+// browsers often rewrite files with the same contents, those only have their
+// metadata merged (see merge_writes_avoided()).
+int merge_overlay(const char *upper, const char *merged, const char *lower,
+                  int flags)
+{
+        plog(LOG_DEBUG, "merging %s into %s", upper, lower);
+
+        struct Merge m = { .keep_newer = (flags & MERGE_KEEP_NEWER) };
+        int err = merge_entry(&m, upper, merged, lower);
+
+        for (size_t i = 0; i < m.removals_num; i++) {
+                if (!(flags & MERGE_FINAL) &&
+                    is_redirect_source(&m, m.removals[i])) {
+                        plog(LOG_DEBUG, "keeping %s until overlay is reset",
+                             m.removals[i]);
+                        continue;
+                }
+                if (remove_path(m.removals[i]) == -1) {
+                        plog(LOG_WARN, "failed removing %s", m.removals[i]);
+                        PERROR();
+                        err = -1;
+                }
+        }
+        free_str_array(m.sources, m.sources_num);
+        free_str_array(m.removals, m.removals_num);
+        free(m.sources);
+        free(m.removals);
+
+        last_unchanged = m.unchanged;
+
+        if (m.unchanged > 0) {
+                char *size = human_readable(m.unchanged);
+
+                plog(LOG_DEBUG, "%s of unchanged files weren't rewritten",
+                     size);
+                free(size);
+        }
+
+        return err;
+}
+
+// bytes the last merge_overlay() didn't rewrite, as they were unchanged
+off_t merge_writes_avoided(void)
+{
+        return last_unchanged;
+}
+
+static int merge_entry(struct Merge *m, const char *upper, const char *merged,
+                       const char *lower)
+{
+        struct stat sb, lsb;
+
+        if (lstat(upper, &sb) == -1) {
+                return -1;
+        }
+        bool lower_exists = (lstat(lower, &lsb) == 0);
+        bool lower_newer =
+                m->keep_newer && lower_exists &&
+                (lsb.st_ctim.tv_sec > sb.st_ctim.tv_sec ||
+                 (lsb.st_ctim.tv_sec == sb.st_ctim.tv_sec &&
+                  lsb.st_ctim.tv_nsec > sb.st_ctim.tv_nsec));
+
+        // entry was deleted
+        if (is_whiteout(upper, &sb)) {
+                if (lower_exists && !lower_newer) {
+                        return append_path(&m->removals, &m->removals_num,
+                                           lower);
+                }
+                return 0;
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
+                // directory was renamed, so its contents may be spread
+                // across layers; just copy it whole
+                if (has_ovl_xattr(upper, "redirect")) {
+                        if (lower_newer) {
+                                return 0;
+                        }
+                        if (add_redirect_sources(m, upper, lower) == -1) {
+                                return -1;
+                        }
+                        if (lower_exists && remove_path(lower) == -1) {
+                                return -1;
+                        }
+                        return copy_path(merged, lower, false);
+                }
+                char opaque[2] = { 0 };
+                bool is_opaque = (get_ovl_xattr(upper, "opaque", opaque, 1) ==
+                                          1 &&
+                                  opaque[0] == 'y');
+
+                // opaque directories hide everything below them
+                if (lower_exists && (is_opaque || !S_ISDIR(lsb.st_mode))) {
+                        if (remove_path(lower) == -1) {
+                                return -1;
+                        }
+                        lower_exists = false;
+                }
+                if (!lower_exists && mkdir(lower, 0700) == -1) {
+                        return -1;
+                }
+                if (merge_dir_entries(m, upper, merged, lower) == -1) {
+                        return -1;
+                }
+                // metadata was already merged into where another overlay
+                // got its lowerdir from
+                if (lower_newer || m->keep_newer) {
+                        return 0;
+                }
+                return copy_metadata(upper, lower);
+        }
+
+        if (lower_newer) {
+                return 0;
+        }
+        if (lower_exists && S_ISDIR(lsb.st_mode) && !S_ISDIR(sb.st_mode)) {
+                if (remove_path(lower) == -1) {
+                        return -1;
+                }
+                lower_exists = false;
+        }
+
+        if (S_ISREG(sb.st_mode)) {
+                // only metadata was copied up, data is still in lower
+                // (or somewhere else in it if it was renamed)
+                if (metacopy_on && has_ovl_xattr(upper, "metacopy")) {
+                        bool renamed = has_ovl_xattr(upper, "redirect");
+
+                        if (renamed &&
+                            add_redirect_sources(m, upper, lower) == -1) {
+                                return -1;
+                        }
+                        if ((!lower_exists || renamed) &&
+                            copy_file(merged, lower) == -1) {
+                                return -1;
+                        }
+                        return copy_metadata(upper, lower);
+                }
+                // skip if unchanged since last merge, images don't
+                // necessarily keep nanoseconds
+                if (lower_exists && S_ISREG(lsb.st_mode) &&
+                    lsb.st_size == sb.st_size &&
+                    lsb.st_mtim.tv_sec == sb.st_mtim.tv_sec &&
+                    (m->keep_newer ||
+                     lsb.st_mtim.tv_nsec == sb.st_mtim.tv_nsec)) {
+                        return 0;
+                }
+                // rewritten with the same contents. reading it back is
+                // cheaper than writing it again. hardlinked files are
+                // replaced as usual, their metadata is shared
+                if (lower_exists && S_ISREG(lsb.st_mode) &&
+                    lsb.st_size == sb.st_size && lsb.st_nlink == 1 &&
+                    files_identical(upper, lower)) {
+                        m->unchanged += sb.st_size;
+                        return copy_metadata(upper, lower);
+                }
+                return copy_file(upper, lower);
+        }
+
+        if (S_ISLNK(sb.st_mode)) {
+                char target[PATH_MAX] = { 0 }, ltarget[PATH_MAX] = { 0 };
+
+                if (readlink(upper, target, PATH_MAX - 1) == -1) {
+                        return -1;
+                }
+                if (lower_exists && S_ISLNK(lsb.st_mode) &&
+                    readlink(lower, ltarget, PATH_MAX - 1) != -1 &&
+                    STR_EQUAL(target, ltarget)) {
+                        return 0;
+                }
+                if (lower_exists && remove_path(lower) == -1) {
+                        return -1;
+                }
+                if (symlink(target, lower) == -1) {
+                        return -1;
+                }
+                return copy_metadata(upper, lower);
+        }
+
+        plog(LOG_DEBUG, "skipping special file %s", upper);
+
+        return 0;
+}
+
+static int merge_dir_entries(struct Merge *m, const char *upper,
+                             const char *merged, const char *lower)
+{
+        DIR *dp = opendir(upper);
+        struct dirent *de = NULL;
+        int err = 0;
+
+        if (dp == NULL) {
+                return -1;
+        }
+        char upath[PATH_MAX], mpath[PATH_MAX], lpath[PATH_MAX];
+
+        while ((de = readdir(dp)) != NULL) {
+                if (name_is_dot(de->d_name)) {
+                        continue;
+                }
+                // what's left stays in the upper dir
+                if (deadline_left() == 0) {
+                        errno = ETIME;
+                        err = -1;
+                        break;
+                }
+                snprintf(upath, PATH_MAX, "%s/%s", upper, de->d_name);
+                snprintf(mpath, PATH_MAX, "%s/%s", merged, de->d_name);
+                snprintf(lpath, PATH_MAX, "%s/%s", lower, de->d_name);
+
+                // stays in the upper dir until it's due
+                if (copy_skips(upath)) {
+                        continue;
+                }
+                // keep going, so that one bad file doesn't stop the rest
+                if (merge_entry(m, upath, mpath, lpath) == -1) {
+                        plog(LOG_WARN, "failed merging %s", upath);
+                        PERROR();
+                        err = -1;
+                }
+        }
+        closedir(dp);
+
+        return err;
+}
+
+// remember where in lower a renamed entry (and anything renamed below it)
+// gets its contents from. redirects are either absolute from the root of
+// lower, or a name in the same directory.
+static int add_redirect_sources(struct Merge *m, const char *upper,
+                                const char *lower)
+{
+        char redirect[PATH_MAX] = { 0 };
+        ssize_t len = get_ovl_xattr(upper, "redirect", redirect, PATH_MAX - 1);
+
+        if (len > 0) {
+                char source[PATH_MAX * 2];
+
+                redirect[len] = 0;
+                if (redirect[0] == '/') {
+                        get_backup_path(source, sizeof(source), redirect);
+                } else {
+                        int dirlen = (int)(strrchr(lower, '/') - lower);
+
+                        snprintf(source, sizeof(source), "%.*s/%s", dirlen,
+                                 lower, redirect);
+                }
+                if (append_path(&m->sources, &m->sources_num, source) == -1) {
+                        return -1;
+                }
+        }
+
+        struct stat sb;
+
+        if (!DIREXISTS(upper)) {
+                return 0;
+        }
+        DIR *dp = opendir(upper);
+        struct dirent *de = NULL;
+        int err = 0;
+
+        if (dp == NULL) {
+                return -1;
+        }
+        char upath[PATH_MAX], lpath[PATH_MAX];
+
+        while ((de = readdir(dp)) != NULL && err == 0) {
+                if (name_is_dot(de->d_name) ||
+                    (de->d_type != DT_DIR && de->d_type != DT_REG &&
+                     de->d_type != DT_UNKNOWN)) {
+                        continue;
+                }
+                snprintf(upath, PATH_MAX, "%s/%s", upper, de->d_name);
+                snprintf(lpath, PATH_MAX, "%s/%s", lower, de->d_name);
+
+                err = add_redirect_sources(m, upath, lpath);
+        }
+        closedir(dp);
+
+        return err;
+}
+
+// check if path is, or contains, something a renamed entry refers to
+static bool is_redirect_source(struct Merge *m, const char *path)
+{
+        size_t len = strlen(path);
+
+        for (size_t i = 0; i < m->sources_num; i++) {
+                if (strncmp(m->sources[i], path, len) == 0 &&
+                    (m->sources[i][len] == 0 || m->sources[i][len] == '/')) {
+                        return true;
+                }
+        }
+        return false;
+}
+
+// path is absolute from the root of the overlay, whose first component
+// is the backup of a dir in one of the backup roots
+static void get_backup_path(char *buf, size_t size, const char *path)
+{
+        struct stat sb;
+        char root[PATH_MAX];
+        int namelen = (int)strcspn(path + 1, "/");
+
+        for (size_t i = 0; next_backup_root(root, &i);) {
+                snprintf(buf, size, "%s/%.*s", root, namelen, path + 1);
+
+                if (LEXISTS(buf)) {
+                        snprintf(buf, size, "%s%s", root, path);
+                        return;
+                }
+        }
+        snprintf(buf, size, "%s%s", PATHS.backups, path);
+}
+
+static int append_path(char ***list, size_t *len, const char *path)
+{
+        char **tmp = realloc(*list, (*len + 1) * sizeof(char *));
+
+        if (tmp == NULL) {
+                return -1;
+        }
+        *list = tmp;
+
+        if ((tmp[*len] = strdup(path)) == NULL) {
+                return -1;
+        }
+        (*len)++;
+
+        return 0;
+}
+
+// whiteouts are 0/0 character devices, or on newer kernels
+// empty files with a whiteout xattr
+static bool is_whiteout(const char *path, const struct stat *sb)
+{
+        if (S_ISCHR(sb->st_mode) && sb->st_rdev == makedev(0, 0)) {
+                return true;
+        }
+        if (S_ISREG(sb->st_mode) && sb->st_size == 0 &&
+            has_ovl_xattr(path, "whiteout")) {
+                return true;
+        }
+        return false;
+}
+
+// overlay xattrs are in the trusted namespace (which needs CAP_SYS_ADMIN
+// to read) unless the overlay is rootless
+static ssize_t get_ovl_xattr(const char *path, const char *name, char *value,
+                             size_t size)
+{
+        char xname[100];
+
+        snprintf(xname, sizeof(xname), "%s.overlay.%s",
+                 CONFIG.rootless_overlay ? "user" : "trusted", name);
+
+        if (CONFIG.rootless_overlay) {
+                return lgetxattr(path, xname, value, size);
+        }
+
+        set_caps(CAP_EFFECTIVE, CAP_SET, 1, CAP_SYS_ADMIN);
+
+        ssize_t len = lgetxattr(path, xname, value, size);
+        int prev_errno = errno;
+
+        set_caps(CAP_EFFECTIVE, CAP_CLEAR, 1, CAP_SYS_ADMIN);
+        errno = prev_errno;
+
+        return len;
+}
+
+static bool has_ovl_xattr(const char *path, const char *name)
+{
+        return get_ovl_xattr(path, name, NULL, 0) != -1;
+}
+
+// drop entries from the upper dir that are identical to lower, so that the
+// overlay falls through to lower again and the RAM they used is freed.
+// should be done right after merge_overlay(), and only while the browser
+// isn't running.
+//
+// removing files from the upper dir behind the back of a mounted overlay is
+// only safe if the overlay doesn't have them cached, so each file is first
+// moved aside and then looked up through the overlay: if it still resolves to
+// the moved file then it is cached (or open) and is put back.
+int compact_overlay(const char *upper, const char *merged, const char *lower)
+{
+        plog(LOG_DEBUG, "compacting %s", upper);
+
+        if (create_dir(PATHS.overlay_trash, 0700) == -1) {
+                return -1;
+        }
+        struct Compaction c = { 0 };
+        const char *bn = strrchr(upper, '/');
+
+        c.upper_root = upper;
+        snprintf(c.root_name, NAME_MAX, "%s", (bn == NULL) ? upper : bn + 1);
+
+        if ((c.open_files = get_open_files(&c.open_files_num)) == NULL) {
+                return -1;
+        }
+
+        int err = compact_dir(&c, upper, merged, lower);
+
+        free_str_array(c.open_files, c.open_files_num);
+        free(c.open_files);
+
+        char *freed = human_readable(c.freed);
+
+        plog(LOG_INFO, "compacting %s freed %s", upper, freed);
+        free(freed);
+
+        return err;
+}
+
+static int compact_dir(struct Compaction *c, const char *upper,
+                       const char *merged, const char *lower)
+{
+        DIR *dp = opendir(upper);
+        struct dirent *de = NULL;
+        struct stat sb, lsb;
+        int err = 0;
+
+        if (dp == NULL) {
+                return -1;
+        }
+        char upath[PATH_MAX], mpath[PATH_MAX], lpath[PATH_MAX];
+
+        while ((de = readdir(dp)) != NULL) {
+                if (name_is_dot(de->d_name)) {
+                        continue;
+                }
+                snprintf(upath, PATH_MAX, "%s/%s", upper, de->d_name);
+                snprintf(mpath, PATH_MAX, "%s/%s", merged, de->d_name);
+                snprintf(lpath, PATH_MAX, "%s/%s", lower, de->d_name);
+
+                if (lstat(upath, &sb) == -1) {
+                        continue;
+                }
+                bool lower_exists = (lstat(lpath, &lsb) == 0);
+
+                // whiteout is useless once lower doesn't have the file
+                if (is_whiteout(upath, &sb)) {
+                        if (!lower_exists && unlink(upath) == -1) {
+                                err = -1;
+                        }
+                } else if (S_ISDIR(sb.st_mode)) {
+                        // directories themselves are kept, as the overlay may
+                        // still be using them. contents of opaque or renamed
+                        // ones don't fall through to lower so they are kept too
+                        char opaque[2] = { 0 };
+
+                        if (!lower_exists || !S_ISDIR(lsb.st_mode) ||
+                            has_ovl_xattr(upath, "redirect") ||
+                            (get_ovl_xattr(upath, "opaque", opaque, 1) == 1 &&
+                             opaque[0] == 'y')) {
+                                continue;
+                        }
+                        if (compact_dir(c, upath, mpath, lpath) == -1) {
+                                err = -1;
+                        }
+                } else if (S_ISREG(sb.st_mode) && lower_exists &&
+                           S_ISREG(lsb.st_mode)) {
+                        if (compact_file(c, upath, mpath, lpath) == -1) {
+                                plog(LOG_WARN, "failed compacting %s", upath);
+                                PERROR();
+                                err = -1;
+                        }
+                }
+        }
+        closedir(dp);
+
+        return err;
+}
+
+static int compact_file(struct Compaction *c, const char *upper,
+                        const char *merged, const char *lower)
+{
+        struct stat sb, lsb, msb;
+
+        if (lstat(upper, &sb) == -1 || lstat(lower, &lsb) == -1) {
+                return -1;
+        }
+        // only compare contents if it looks the same
+        if ((metacopy_on && has_ovl_xattr(upper, "metacopy")) ||
+            sb.st_size != lsb.st_size ||
+            sb.st_mtim.tv_sec != lsb.st_mtim.tv_sec ||
+            sb.st_mtim.tv_nsec != lsb.st_mtim.tv_nsec ||
+            (sb.st_mode & 07777) != (lsb.st_mode & 07777) ||
+            compaction_file_open(c, upper) || !files_identical(upper, lower)) {
+                return 0;
+        }
+        char staged[PATH_MAX];
+
+        snprintf(staged, PATH_MAX, "%s/%zu", PATHS.overlay_trash,
+                 c->staged_num++);
+
+        if (rename(upper, staged) == -1) {
+                return -1;
+        }
+
+        // a fresh lookup resolves to lower, a cached one still to the
+        // moved file (which has a new ctime from the rename)
+        if (stat(merged, &msb) == 0 && msb.st_size == lsb.st_size &&
+            msb.st_ctim.tv_sec == lsb.st_ctim.tv_sec &&
+            msb.st_ctim.tv_nsec == lsb.st_ctim.tv_nsec) {
+                c->freed += sb.st_size;
+                return unlink(staged);
+        }
+
+        plog(LOG_DEBUG, "%s is in use, not compacting it", merged);
+
+        // if it was copied up again in the meantime then that copy wins
+        if (renameat2(AT_FDCWD, staged, AT_FDCWD, upper, RENAME_NOREPLACE) ==
+                    -1 &&
+            errno == EEXIST) {
+                return unlink(staged);
+        }
+
+        return 0;
+}
+
+// check if file in the upper dir is opened through the overlay by anyone
+static bool compaction_file_open(struct Compaction *c, const char *upper)
+{
+        char needle[PATH_MAX];
+
+        snprintf(needle, PATH_MAX, "/%s%s", c->root_name,
+                 upper + strlen(c->upper_root));
+
+        size_t needle_len = strlen(needle);
+
+        for (size_t i = 0; i < c->open_files_num; i++) {
+                size_t len = strlen(c->open_files[i]);
+
+                if (len >= needle_len &&
+                    STR_EQUAL(c->open_files[i] + len - needle_len, needle)) {
+                        return true;
+                }
+        }
+
+        return false;
 }
 
 #endif
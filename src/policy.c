@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include "policy.h"
+#include "log.h"
+#include "state.h"
+#include "util.h"
+
+#include <stdlib.h>
+
+// files that are rewritten all the time (session stores, database journals)
+// don't have to be copied on every resync. each browser has a list of globs
+// with how often what they match is resynced, and the first one that matches
+// a file decides. a glob without a '/' matches names anywhere, else paths
+// from the root of the directory.
+//
+// the policies of a directory are turned into a filter for the copy engine
+// (see set_copy_filter()) for the length of a resync: always copied files
+// are included, the rest are excluded unless it's their turn. excluded files
+// are left as they were in the backup.
+//
+// regenerable data (code caches, GPU shader caches...) is excluded with
+// exclude = <glob>. it's left out of the copy into the tmpfs and of every
+// resync, whatever the policies say. depending on exclude_mode it's either
+// linked back to the backup, so that it stays on disk, or recreated by the
+// browser in the tmpfs and dropped when unsyncing.
+
+static int add_glob(struct Policy **policies, size_t *policies_num,
+                    struct Policy *policy, const char *glob);
+static int set_filter(struct Dir *dir, const char *root, bool policies,
+                      bool final);
+
+static char **filter_rules = NULL;
+static size_t filter_rules_num = 0;
+
+// parse "<always|every:N|unsync|never> <glob>" and append it to policies
+int add_policy(struct Policy **policies, size_t *policies_num,
+               const char *value)
+{
+        struct Policy policy = { 0 };
+        char class[32] = { 0 };
+        int off = 0;
+
+        if (sscanf(value, "%31s %n", class, &off) != 1 || value[off] == 0) {
+                plog(LOG_ERROR, "policy '%s' is not '<class> <glob>'", value);
+                return -1;
+        }
+        if (STR_EQUAL(class, "always")) {
+                policy.class = POLICY_ALWAYS;
+        } else if (STR_EQUAL(class, "unsync")) {
+                policy.class = POLICY_UNSYNC;
+        } else if (STR_EQUAL(class, "never")) {
+                policy.class = POLICY_NEVER;
+        } else if (sscanf(class, "every:%d", &policy.every) == 1 &&
+                   policy.every > 0) {
+                policy.class = POLICY_EVERY;
+        } else {
+                plog(LOG_ERROR, "unknown policy class '%s'", class);
+                return -1;
+        }
+
+        return add_glob(policies, policies_num, &policy, value + off);
+}
+
+// append an exclusion of glob to policies
+int add_exclude(struct Policy **policies, size_t *policies_num,
+                const char *glob)
+{
+        struct Policy policy = { .class = POLICY_EXCLUDE };
+
+        return add_glob(policies, policies_num, &policy, glob);
+}
+
+// append glob to the files that ephemeral caches are seeded with
+int add_seed(struct Policy **policies, size_t *policies_num, const char *glob)
+{
+        struct Policy policy = { .class = POLICY_SEED };
+
+        return add_glob(policies, policies_num, &policy, glob);
+}
+
+// filter the copies of root (the tmpfs of dir, or its upper dir) by the
+// policies of dir, for its next resync. final is for the last one before
+// unsyncing
+int set_policy_filter(struct Dir *dir, const char *root, bool final)
+{
+        return set_filter(dir, root, true, final);
+}
+
+// filter the copies of root (dir, its backup or its tmpfs) by the exclusions
+// of dir only, for copying it into the tmpfs or back
+int set_exclude_filter(struct Dir *dir, const char *root)
+{
+        return set_filter(dir, root, false, false);
+}
+
+static int add_glob(struct Policy **policies, size_t *policies_num,
+                    struct Policy *policy, const char *glob)
+{
+        size_t len = strlen(glob);
+
+        while (len > 1 && glob[len - 1] == '/') {
+                len--;
+        }
+        // it's quoted for rsync
+        if (strchr(glob, '\'') != NULL) {
+                plog(LOG_ERROR, "glob '%s' can't contain quotes", glob);
+                return -1;
+        }
+        snprintf(policy->glob, PATH_MAX, "%s%.*s",
+                 (glob[0] != '/' && memchr(glob, '/', len) != NULL) ? "/" : "",
+                 (int)len, glob);
+
+        struct Policy *tmp =
+                realloc(*policies, (*policies_num + 1) * sizeof(**policies));
+
+        if (tmp == NULL) {
+                return -1;
+        }
+        *policies = tmp;
+        (*policies)[(*policies_num)++] = *policy;
+
+        return 0;
+}
+
+// exclusions come first, so that no policy can bring them back
+static int set_filter(struct Dir *dir, const char *root, bool policies,
+                      bool final)
+{
+        struct Browser *browser = dir->browser;
+
+        clear_policy_filter();
+
+        if (browser->policies_num == 0) {
+                return 0;
+        }
+        filter_rules = calloc(browser->policies_num, sizeof(*filter_rules));
+
+        if (filter_rules == NULL) {
+                return -1;
+        }
+        // counting this one
+        long long resyncs = get_resync_count(dir) + 1;
+
+        for (int pass = 0; pass < 2; pass++) {
+                for (size_t i = 0; i < browser->policies_num; i++) {
+                        struct Policy *policy = &browser->policies[i];
+                        bool exclude = (policy->class == POLICY_EXCLUDE);
+
+                        if (exclude != (pass == 0) || (!exclude && !policies) ||
+                            policy->class == POLICY_SEED) {
+                                continue;
+                        }
+                        bool skip =
+                                exclude || (policy->class == POLICY_NEVER) ||
+                                (policy->class == POLICY_UNSYNC && !final) ||
+                                (policy->class == POLICY_EVERY && !final &&
+                                 resyncs % policy->every != 0);
+
+                        if (asprintf(&filter_rules[filter_rules_num], "%c %s",
+                                     skip ? '-' : '+', policy->glob) == -1) {
+                                clear_policy_filter();
+                                return -1;
+                        }
+                        filter_rules_num++;
+                }
+        }
+        set_copy_filter(root, filter_rules, filter_rules_num);
+
+        return 0;
+}
+
+void clear_policy_filter(void)
+{
+        set_copy_filter(NULL, NULL, 0);
+        free_str_array(filter_rules, filter_rules_num);
+        free(filter_rules);
+        filter_rules = NULL;
+        filter_rules_num = 0;
+}
+
+// vim: sw=8 ts=8
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include "recovery.h"
+#include "log.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// index lines are "<kind> <path>", the first line is the directory the
+// files belong to, the rest are files relative to it
+#define KIND_DIR 'D'
+#define KIND_CHANGED 'M'
+#define KIND_ADDED 'A'
+
+static bool entry_differs(const char *stale, const struct stat *sb,
+                          const char *live, char *kind);
+static int save_entry(const char *fpath, const struct stat *sb, int typeflag,
+                      struct FTW *ftwbuf);
+static int copy_entry(const char *src, const char *dest);
+
+// state for save_entry(), nftw doesn't take a context
+static const char *walk_stale, *walk_live, *walk_recovery;
+static FILE *walk_index;
+static size_t walk_saved;
+
+// save the files in stale that differ from dir into a new recovery dir,
+// returns how many were saved (if none, recovery isn't created)
+int save_recovery(struct Dir *dir, const char *stale, const char *recovery)
+{
+        char index[PATH_MAX];
+
+        if (mkdir(recovery, 0700) == -1) {
+                return -1;
+        }
+        snprintf(index, PATH_MAX, "%s/" RECOVERY_INDEX, recovery);
+
+        if ((walk_index = fopen(index, "w")) == NULL) {
+                rmdir(recovery);
+                return -1;
+        }
+        fprintf(walk_index, "%c %s\n", KIND_DIR, dir->path);
+
+        walk_stale = stale;
+        walk_live = dir->path;
+        walk_recovery = recovery;
+        walk_saved = 0;
+
+        int err = nftw(stale, save_entry, MAX_FD, FTW_PHYS);
+
+        if (fclose(walk_index) == EOF) {
+                err = -1;
+        }
+        if (err == -1 || walk_saved == 0) {
+                int prev_errno = errno;
+
+                remove_path(recovery);
+                errno = prev_errno;
+
+                return err;
+        }
+
+        return (int)walk_saved;
+}
+
+// true if recovery was made by save_recovery() rather than being a whole
+// directory (older versions, or when saving failed)
+bool is_recovery_bundle(const char *recovery)
+{
+        struct stat sb;
+        char index[PATH_MAX];
+
+        snprintf(index, PATH_MAX, "%s/" RECOVERY_INDEX, recovery);
+
+        return FEXISTS(index);
+}
+
+// print the files in recovery, each line starting with indent
+int print_recovery(const char *recovery, const char *indent)
+{
+        char index[PATH_MAX], line[PATH_MAX + 3];
+
+        snprintf(index, PATH_MAX, "%s/" RECOVERY_INDEX, recovery);
+
+        FILE *fp = fopen(index, "r");
+
+        if (fp == NULL) {
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                line[strcspn(line, "\n")] = 0;
+
+                if (line[0] == KIND_CHANGED) {
+                        printf("%schanged  %s\n", indent, line + 2);
+                } else if (line[0] == KIND_ADDED) {
+                        printf("%sadded    %s\n", indent, line + 2);
+                }
+        }
+        fclose(fp);
+
+        return 0;
+}
+
+// copy the files in recovery that match pattern (all if NULL) back into dir,
+// replacing what's there
+int restore_recovery(struct Dir *dir, const char *recovery,
+                     const char *pattern)
+{
+        char index[PATH_MAX], line[PATH_MAX + 3];
+        int err = 0;
+
+        snprintf(index, PATH_MAX, "%s/" RECOVERY_INDEX, recovery);
+
+        FILE *fp = fopen(index, "r");
+
+        if (fp == NULL) {
+                return -1;
+        }
+
+        // belongs to another directory with the same name
+        if (fgets(line, sizeof(line), fp) == NULL || line[0] != KIND_DIR ||
+            strncmp(line + 2, dir->path, strlen(dir->path)) != 0 ||
+            line[2 + strlen(dir->path)] != '\n') {
+                fclose(fp);
+                return 0;
+        }
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                line[strcspn(line, "\n")] = 0;
+
+                const char *rel = line + 2;
+
+                if ((line[0] != KIND_CHANGED && line[0] != KIND_ADDED) ||
+                    (pattern != NULL && fnmatch(pattern, rel, 0) != 0)) {
+                        continue;
+                }
+                char src[PATH_MAX], dest[PATH_MAX];
+
+                snprintf(src, PATH_MAX, "%s/" RECOVERY_FILES "/%s", recovery,
+                         rel);
+                snprintf(dest, PATH_MAX, "%s/%s", dir->path, rel);
+
+                plog(LOG_INFO, "restoring %s", dest);
+
+                if (copy_entry(src, dest) == -1) {
+                        plog(LOG_ERROR, "failed restoring %s", dest);
+                        PERROR();
+                        err = -1;
+                }
+        }
+        fclose(fp);
+
+        return err;
+}
+
+// kind is set to what the difference is
+static bool entry_differs(const char *stale, const struct stat *sb,
+                          const char *live, char *kind)
+{
+        struct stat lsb;
+
+        *kind = KIND_CHANGED;
+
+        if (lstat(live, &lsb) == -1) {
+                *kind = KIND_ADDED;
+                return true;
+        }
+        if ((sb->st_mode & S_IFMT) != (lsb.st_mode & S_IFMT)) {
+                return true;
+        }
+        if (S_ISLNK(sb->st_mode)) {
+                char target[PATH_MAX] = { 0 }, ltarget[PATH_MAX] = { 0 };
+
+                return readlink(stale, target, PATH_MAX - 1) == -1 ||
+                       readlink(live, ltarget, PATH_MAX - 1) == -1 ||
+                       !STR_EQUAL(target, ltarget);
+        }
+
+        // same size and mtime is taken as unchanged, like rsync does
+        if (sb->st_size == lsb.st_size &&
+            sb->st_mtim.tv_sec == lsb.st_mtim.tv_sec &&
+            sb->st_mtim.tv_nsec == lsb.st_mtim.tv_nsec) {
+                return false;
+        }
+
+        return !files_identical(stale, live);
+}
+
+static int save_entry(const char *fpath, const struct stat *sb, int typeflag,
+                      struct FTW *UNUSED(ftwbuf))
+{
+        if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+                errno = EACCES;
+                return -1;
+        }
+        // dirs are created as needed, anything else isn't worth saving
+        if (!S_ISREG(sb->st_mode) && !S_ISLNK(sb->st_mode)) {
+                return 0;
+        }
+        const char *rel = fpath + strlen(walk_stale) + 1;
+        char live[PATH_MAX], dest[PATH_MAX], kind;
+
+        // would break the index
+        if (strchr(rel, '\n') != NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+        snprintf(live, PATH_MAX, "%s/%s", walk_live, rel);
+
+        if (!entry_differs(fpath, sb, live, &kind)) {
+                return 0;
+        }
+        snprintf(dest, PATH_MAX, "%s/" RECOVERY_FILES "/%s", walk_recovery,
+                 rel);
+
+        if (copy_entry(fpath, dest) == -1 ||
+            fprintf(walk_index, "%c %s\n", kind, rel) < 0) {
+                return -1;
+        }
+        walk_saved++;
+
+        return 0;
+}
+
+// copy a file or symlink to dest, creating its parents
+static int copy_entry(const char *src, const char *dest)
+{
+        struct stat sb;
+        char parent[PATH_MAX];
+
+        snprintf(parent, PATH_MAX, "%s", dest);
+
+        if (create_dir(dirname(parent), 0700) == -1 || lstat(src, &sb) == -1) {
+                return -1;
+        }
+        // copy_file replaces dest atomically
+        if (S_ISREG(sb.st_mode)) {
+                return copy_file(src, dest);
+        }
+        if (LEXISTS(dest) && unlink(dest) == -1) {
+                return -1;
+        }
+
+        return clone_path(src, dest, 0);
+}
+
+// vim: sw=8 ts=8
@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+#include "schedule.h"
+#include "config.h"
+#include "log.h"
+#include "overlay.h"
+#include "policy.h"
+#include "state.h"
+#include "sync.h"
+#include "util.h"
+
+#include <ftw.h>
+#include <stdlib.h>
+
+// resyncs are run often by the timer, but only go through when enough is at
+// risk or it has been at risk for long enough. what's at risk is sampled from
+// the tmpfs (or the upper dir of the overlay): files written since the last
+// flush of their directory, by mtime. a resync that's due because of how much
+// is at risk waits for the browsers to stop writing, as copies are then
+// consistent and there's less to redo. one that's due because of its age
+// doesn't. files that the next resync leaves out by policy aren't at risk of
+// anything it would fix.
+
+static int add_entry_risk(const char *fpath, const struct stat *sb,
+                          int typeflag, struct FTW *ftwbuf);
+
+// state for add_entry_risk(), nftw doesn't take a context
+static struct Risk *walk_risk;
+static time_t walk_flushed;
+
+// add what's at risk in dir to risk
+int add_dir_risk(struct Dir *dir, struct Risk *risk)
+{
+        struct stat sb;
+        char backup[PATH_MAX], tmpfs[PATH_MAX];
+
+        // nothing to lose that a resync would save
+        if (!SYMEXISTS(dir->path) || !dir_resynced(dir) ||
+            get_paths(dir, backup, tmpfs) == -1) {
+                return 0;
+        }
+#ifndef NOOVERLAY
+        if (overlay_mounted() && get_overlay_paths(dir, tmpfs) == -1) {
+                return -1;
+        }
+#endif
+        // nothing was changed
+        if (!DIREXISTS(tmpfs)) {
+                return 0;
+        }
+        struct Risk dir_risk = { 0 };
+
+        walk_risk = &dir_risk;
+        walk_flushed = get_flush_time(dir);
+
+        if (set_policy_filter(dir, tmpfs, false) == -1) {
+                return -1;
+        }
+        int err = nftw(tmpfs, add_entry_risk, MAX_FD,
+                       FTW_PHYS | FTW_ACTIONRETVAL);
+
+        clear_policy_filter();
+
+        if (err == -1) {
+                return -1;
+        }
+        if (dir_risk.bytes == 0) {
+                return 0;
+        }
+        risk->bytes += dir_risk.bytes;
+
+        if (risk->flushed == 0 || walk_flushed < risk->flushed) {
+                risk->flushed = walk_flushed;
+        }
+        if (dir_risk.written > risk->written) {
+                risk->written = dir_risk.written;
+        }
+
+        return 0;
+}
+
+// true if a resync should be done now
+bool resync_due(void)
+{
+        struct Risk risk = { 0 };
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+
+                        // unknown, so don't wait for it
+                        if (dir->selected && add_dir_risk(dir, &risk) == -1) {
+                                plog(LOG_WARN, "failed checking %s, resyncing",
+                                     dir->path);
+                                return true;
+                        }
+                }
+        }
+        if (risk.bytes == 0) {
+                plog(LOG_INFO, "nothing was written since the last resync");
+                return false;
+        }
+        time_t now = time(NULL);
+        char *size = human_readable(risk.bytes);
+
+        plog(LOG_INFO, "%s at risk, for %lld seconds", size,
+             (long long)(now - risk.flushed));
+        free(size);
+
+        bool over_budget = CONFIG.resync_budget > 0 &&
+                           risk.bytes >= CONFIG.resync_budget,
+             too_old = now - risk.flushed >= CONFIG.resync_max_age;
+
+        if (!over_budget && !too_old) {
+                plog(LOG_INFO, "resync is not due yet");
+                return false;
+        }
+        if (!too_old && now - risk.written < CONFIG.resync_quiet) {
+                plog(LOG_INFO, "browsers are still writing, postponing resync");
+                return false;
+        }
+
+        return true;
+}
+
+static int add_entry_risk(const char *fpath, const struct stat *sb,
+                          int typeflag, struct FTW *UNUSED(ftwbuf))
+{
+        if (copy_skips(fpath)) {
+                return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+        }
+        if (typeflag == FTW_NS || !S_ISREG(sb->st_mode) ||
+            sb->st_mtime < walk_flushed) {
+                return FTW_CONTINUE;
+        }
+        walk_risk->bytes += sb->st_size;
+
+        if (sb->st_mtime > walk_risk->written) {
+                walk_risk->written = sb->st_mtime;
+        }
+
+        return FTW_CONTINUE;
+}
+
+// vim: sw=8 ts=8
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include "state.h"
+#include "config.h"
+#include "log.h"
+#include "overlay.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// the state file has a line for each directory with the state it was left in
+// and fingerprints of the symlink (or directory), backup and tmpfs at the
+// time. if none of them changed since, then neither did the state, and the
+// directory doesn't have to be checked again.
+//
+// the tmpfs is written to by the browser, so its mtime isn't part of its
+// fingerprint. it's only ever replaced as a whole, which changes its inode.
+//
+// it also has when the tmpfs was last flushed to the backup (or copied from
+// it), anything written after that isn't backed up yet, how many bytes of
+// unchanged files that flush didn't have to rewrite, and how many times the
+// directory was resynced.
+struct Fingerprint {
+        unsigned long long dev, ino;
+        long long sec;
+        long nsec;
+};
+
+struct Record {
+        enum DirState state;
+        struct Fingerprint link, backup, tmpfs;
+        long long flushed, avoided, resyncs;
+        char path[PATH_MAX];
+};
+
+static int load_records(void);
+static int save_records(void);
+static struct Record *find_record(struct Dir *dir);
+static void get_fingerprint(const char *path, bool follow, bool with_mtime,
+                            struct Fingerprint *fp);
+static void get_fingerprints(struct Dir *dir, const char *backup,
+                             const char *tmpfs, struct Record *rec);
+static bool fingerprints_equal(const struct Record *a, const struct Record *b);
+static enum DirState probe_state(struct Dir *dir);
+
+// loaded once, the state file is small
+static struct Record *records = NULL;
+static size_t records_num = 0;
+static bool records_loaded = false;
+
+// true if dir is still in the state it was recorded in
+bool state_unchanged(struct Dir *dir, const char *backup, const char *tmpfs)
+{
+        if (load_records() == -1) {
+                return false;
+        }
+        struct Record *rec = find_record(dir), now;
+
+        if (rec == NULL) {
+                return false;
+        }
+        get_fingerprints(dir, backup, tmpfs, &now);
+
+        return fingerprints_equal(rec, &now);
+}
+
+// the recorded state of dir if it's still valid, else what it looks like now
+enum DirState get_dir_state(struct Dir *dir, const char *backup,
+                            const char *tmpfs)
+{
+        if (state_unchanged(dir, backup, tmpfs)) {
+                return find_record(dir)->state;
+        }
+
+        return probe_state(dir);
+}
+
+// record the current state of dir, should only be done once it's consistent.
+// flush is NULL if the tmpfs wasn't flushed
+int record_state(struct Dir *dir, const char *backup, const char *tmpfs,
+                 const struct Flush *flush)
+{
+        if (load_records() == -1) {
+                return -1;
+        }
+        struct Record *rec = find_record(dir);
+
+        if (rec == NULL) {
+                struct Record *tmp = realloc(
+                        records, (records_num + 1) * sizeof(struct Record));
+
+                if (tmp == NULL) {
+                        return -1;
+                }
+                records = tmp;
+                rec = &records[records_num++];
+                rec->flushed = 0;
+                rec->avoided = 0;
+                rec->resyncs = 0;
+                snprintf(rec->path, PATH_MAX, "%s", dir->path);
+        }
+        get_fingerprints(dir, backup, tmpfs, rec);
+        rec->state = probe_state(dir);
+
+        if (flush != NULL) {
+                rec->flushed = flush->at;
+                rec->avoided = flush->avoided;
+                rec->resyncs += flush->resync ? 1 : 0;
+        }
+
+        return save_records();
+}
+
+// the symlink of dir was pointed to a new tmpfs (the overlay was remounted),
+// which leaves it as consistent as it was
+int refresh_state(struct Dir *dir, const char *backup, const char *tmpfs)
+{
+        if (load_records() == -1) {
+                return -1;
+        }
+        struct Record *rec = find_record(dir), now;
+
+        if (rec == NULL) {
+                return 0;
+        }
+        get_fingerprints(dir, backup, tmpfs, &now);
+
+        // something else changed too
+        if (memcmp(&rec->backup, &now.backup, sizeof(now.backup)) != 0) {
+                return forget_state(dir);
+        }
+        rec->link = now.link;
+        rec->tmpfs = now.tmpfs;
+        rec->state = probe_state(dir);
+
+        return save_records();
+}
+
+// when the tmpfs of dir was last flushed, 0 if unknown
+time_t get_flush_time(struct Dir *dir)
+{
+        if (load_records() == -1) {
+                return 0;
+        }
+        struct Record *rec = find_record(dir);
+
+        return (rec != NULL) ? (time_t)rec->flushed : 0;
+}
+
+// bytes the last flush of dir didn't rewrite, as they were unchanged
+off_t get_writes_avoided(struct Dir *dir)
+{
+        if (load_records() == -1) {
+                return 0;
+        }
+        struct Record *rec = find_record(dir);
+
+        return (rec != NULL) ? (off_t)rec->avoided : 0;
+}
+
+// how many times dir was resynced since it was first recorded
+long long get_resync_count(struct Dir *dir)
+{
+        if (load_records() == -1) {
+                return 0;
+        }
+        struct Record *rec = find_record(dir);
+
+        return (rec != NULL) ? rec->resyncs : 0;
+}
+
+// dir will be checked fully the next time
+int forget_state(struct Dir *dir)
+{
+        if (load_records() == -1) {
+                return -1;
+        }
+        struct Record *rec = find_record(dir);
+
+        if (rec == NULL) {
+                return 0;
+        }
+        *rec = records[--records_num];
+
+        return save_records();
+}
+
+static int load_records(void)
+{
+        if (records_loaded) {
+                return 0;
+        }
+        FILE *fp = fopen(PATHS.state, "r");
+
+        if (fp == NULL) {
+                records_loaded = true;
+                return (errno == ENOENT) ? 0 : -1;
+        }
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t len = 0;
+
+        while ((len = getline(&line, &size, fp)) != -1) {
+                struct Record rec;
+                int state = 0, off = 0;
+
+                if (line[len - 1] == '\n') {
+                        line[len - 1] = 0;
+                }
+                // ignore lines that can't be parsed, they are checked again
+                if (sscanf(line,
+                           "%d %llu %llu %lld %ld %llu %llu %lld %ld "
+                           "%llu %llu %lld %lld %lld %n",
+                           &state, &rec.link.dev, &rec.link.ino, &rec.link.sec,
+                           &rec.link.nsec, &rec.backup.dev, &rec.backup.ino,
+                           &rec.backup.sec, &rec.backup.nsec, &rec.tmpfs.dev,
+                           &rec.tmpfs.ino, &rec.flushed, &rec.avoided,
+                           &rec.resyncs, &off) != 14 ||
+                    off == 0 || line[off] != '/' || state < STATE_UNSYNCED ||
+                    state > STATE_OVERLAY) {
+                        continue;
+                }
+                struct Record *tmp = realloc(
+                        records, (records_num + 1) * sizeof(struct Record));
+
+                if (tmp == NULL) {
+                        free(line);
+                        fclose(fp);
+                        return -1;
+                }
+                records = tmp;
+                rec.state = state;
+                rec.tmpfs.sec = 0;
+                rec.tmpfs.nsec = 0;
+                snprintf(rec.path, PATH_MAX, "%s", line + off);
+                records[records_num++] = rec;
+        }
+        free(line);
+        fclose(fp);
+
+        records_loaded = true;
+
+        return 0;
+}
+
+// the state file is replaced atomically, so it's never half written
+static int save_records(void)
+{
+        char tmp[PATH_MAX];
+
+        snprintf(tmp, PATH_MAX, "%s.tmp", PATHS.state);
+
+        FILE *fp = fopen(tmp, "w");
+
+        if (fp == NULL) {
+                return -1;
+        }
+
+        for (size_t i = 0; i < records_num; i++) {
+                struct Record *rec = &records[i];
+
+                // would break the state file
+                if (strchr(rec->path, '\n') != NULL) {
+                        continue;
+                }
+                fprintf(fp,
+                        "%d %llu %llu %lld %ld %llu %llu %lld %ld "
+                        "%llu %llu %lld %lld %lld %s\n",
+                        rec->state, rec->link.dev, rec->link.ino, rec->link.sec,
+                        rec->link.nsec, rec->backup.dev, rec->backup.ino,
+                        rec->backup.sec, rec->backup.nsec, rec->tmpfs.dev,
+                        rec->tmpfs.ino, rec->flushed, rec->avoided,
+                        rec->resyncs, rec->path);
+        }
+
+        if (fclose(fp) == EOF || rename(tmp, PATHS.state) == -1) {
+                int prev_errno = errno;
+
+                unlink(tmp);
+                errno = prev_errno;
+
+                return -1;
+        }
+
+        return 0;
+}
+
+static struct Record *find_record(struct Dir *dir)
+{
+        for (size_t i = 0; i < records_num; i++) {
+                if (STR_EQUAL(records[i].path, dir->path)) {
+                        return &records[i];
+                }
+        }
+
+        return NULL;
+}
+
+// paths that don't exist are all zeros
+static void get_fingerprint(const char *path, bool follow, bool with_mtime,
+                            struct Fingerprint *fp)
+{
+        struct stat sb;
+
+        memset(fp, 0, sizeof(*fp));
+
+        if ((follow ? stat(path, &sb) : lstat(path, &sb)) == -1) {
+                return;
+        }
+        fp->dev = sb.st_dev;
+        fp->ino = sb.st_ino;
+
+        if (with_mtime) {
+                fp->sec = sb.st_mtim.tv_sec;
+                fp->nsec = sb.st_mtim.tv_nsec;
+        }
+}
+
+static void get_fingerprints(struct Dir *dir, const char *backup,
+                             const char *tmpfs, struct Record *rec)
+{
+        get_fingerprint(dir->path, false, true, &rec->link);
+        get_fingerprint(backup, true, true, &rec->backup);
+        get_fingerprint(tmpfs, true, false, &rec->tmpfs);
+}
+
+static bool fingerprints_equal(const struct Record *a, const struct Record *b)
+{
+        const struct Fingerprint *fa[] = { &a->link, &a->backup, &a->tmpfs },
+                                 *fb[] = { &b->link, &b->backup, &b->tmpfs };
+
+        for (size_t i = 0; i < 3; i++) {
+                if (fa[i]->dev != fb[i]->dev || fa[i]->ino != fb[i]->ino ||
+                    fa[i]->sec != fb[i]->sec || fa[i]->nsec != fb[i]->nsec) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static enum DirState probe_state(struct Dir *dir)
+{
+        struct stat sb;
+
+        if (!SYMEXISTS(dir->path)) {
+                return STATE_UNSYNCED;
+        }
+#ifndef NOOVERLAY
+        if (overlay_mounted()) {
+                return STATE_OVERLAY;
+        }
+#endif
+
+        return STATE_SYNCED;
+}
+
+// vim: sw=8 ts=8
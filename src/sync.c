@@ -1,7 +1,14 @@
 #define _GNU_SOURCE
 #include "sync.h"
+#include "generation.h"
+#include "hydrate.h"
+#include "journal.h"
+#include "lock.h"
 #include "log.h"
 #include "overlay.h"
+#include "policy.h"
+#include "recovery.h"
+#include "state.h"
 #include "types.h"
 #include "util.h"
 #include "config.h"
@@ -10,6 +17,7 @@
 #include <libgen.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <ftw.h>
 
 #include <sys/types.h>
 #include <string.h>
@@ -19,26 +27,77 @@
 
 static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay);
 static int unsync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
-                      bool overlay);
+                      bool overlay, bool skip_caches);
 static int resync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
-                      bool overlay);
+                      bool overlay, bool final, bool skip_caches);
+
+static int detach_dir(struct Dir *dir, char *backup, char *tmpfs,
+                      char *otmpfs, bool overlay, bool skip_caches);
+static int rollback_dir(struct Dir *dir, char *backup, char *tmpfs,
+                        char *otmpfs, bool overlay, bool skip_caches);
 
 #ifndef NOOVERLAY
-static int repoint_dirs(const char *target);
+static int merge_overlay_dirs(void);
 #endif
 
+static bool state_is_current(struct Dir *dir, const char *backup,
+                             const char *tmpfs);
 static int repair_state(struct Dir *dir, char *backup, char *tmpfs,
                         bool overlay);
 static int fix_session(struct Dir *dir, char *backup, char *tmpfs,
                        bool overlay);
-static int fix_backup(char *backup, char *tmpfs);
-static int fix_tmpfs(char *backup, char *tmpfs, bool overlay);
+static int fix_backup(struct Dir *dir, char *backup, char *tmpfs);
+static int fix_tmpfs(struct Dir *dir, char *backup, char *tmpfs, bool overlay);
 
 static int recover_path(struct Dir *syncdir, const char *path);
+static int copy_to_tmpfs(struct Dir *dir, const char *src, const char *tmpfs,
+                         const char *backup);
+static int link_excluded(const char *src, const char *tmpfs,
+                         const char *backup);
+static int link_entry(const char *fpath, const struct stat *sb, int typeflag,
+                      struct FTW *ftwbuf);
+static int seed_tmpfs(struct Dir *dir, const char *src, const char *tmpfs);
+static int seed_entry(const char *fpath, const struct stat *sb, int typeflag,
+                      struct FTW *ftwbuf);
+static int resync_tmpfs(const char *tmpfs, const char *backup);
+static bool lazy_syncing(void);
 
 static int clear_cache(struct Dir *dir, const char *backup, const char *tmpfs);
 
+static time_t last_written(struct Dir *dir, bool overlay);
+static int find_newest(const char *fpath, const struct stat *sb, int typeflag,
+                       struct FTW *ftwbuf);
+static int compare_value(const void *a, const void *b);
+
 static bool directory_is_safe(struct Dir *dir);
+static void get_backup_root(struct Dir *dir, const char *name, char *root);
+static bool has_backup_root(const char *root);
+static bool backup_root_is_safe(const char *path);
+static void remove_backup_root(const char *backup);
+static void get_snapshot_path(const char *backup, char *snapshot);
+static int snapshot_backup(const char *backup);
+static void remove_snapshot(const char *backup);
+
+// generation to roll back to instead of the snapshots, if set
+static char rollback_generation[PATH_MAX];
+
+// state for link_entry() and seed_entry(), nftw doesn't take a context
+static const char *walk_src = NULL, *walk_tmpfs = NULL, *walk_backup = NULL;
+static struct Dir *walk_dir = NULL;
+
+// when the directory being handled was last made the same as its backup,
+// at is 0 if it wasn't
+static struct Flush flush;
+
+// newest mtime seen by find_newest(), nftw doesn't take a context
+static time_t newest_mtime;
+
+// a directory and how much it's worth flushing before a deadline
+struct Valued {
+        struct Dir *dir;
+        time_t written;
+        enum { VALUE_PENDING, VALUE_DONE, VALUE_FAILED } result;
+};
 
 // perform action on directories of browser
 int do_action_on_browser(struct Browser *browser, enum Action action,
@@ -47,69 +106,201 @@ int do_action_on_browser(struct Browser *browser, enum Action action,
         plog(LOG_INFO, "doing '%s' on browser %s", action_str[action],
              browser->name);
 
-        char backup[PATH_MAX], tmpfs[PATH_MAX], otmpfs[PATH_MAX];
         int did_something = 0;
 
         for (size_t i = 0; i < browser->dirs_num; i++) {
                 struct Dir *dir = browser->dirs[i];
-                int err = 0;
-
-                if (!directory_is_safe(dir)) {
-                        plog(LOG_WARN, "directory %s is unsafe, skipping",
-                             dir->path);
-                        continue;
-                }
 
-                // get required paths
-                if (get_paths(dir, backup, tmpfs) == -1) {
-                        plog(LOG_WARN, "failed getting required paths for %s",
-                             dir->path);
-                        continue;
+                // a more urgent instance takes over from here
+                if (action == ACTION_RESYNC && lock_cancelled()) {
+                        break;
                 }
-#ifndef NOOVERLAY
-                if ((action == ACTION_UNSYNC || action == ACTION_RESYNC) &&
-                    overlay && get_overlay_paths(dir, otmpfs) == -1) {
-                        plog(LOG_WARN, "failed getting overlay path for %s",
-                             dir->path);
-                        continue;
+                if (dir->selected &&
+                    do_action_on_dir(dir, action, overlay, false) == 0) {
+                        did_something++;
                 }
-#endif
+        }
 
-                // clear cache in tmpfs and backup
-                if (action == ACTION_RMCACHE && dir->type == DIR_CACHE) {
-                        if (clear_cache(dir, backup, tmpfs) == -1) {
-                                plog(LOG_ERROR, "failed clearing cache for %s",
-                                     dir->path);
+        return (did_something > 0) ? 0 : -1;
+}
+
+// like do_action_on_browser() on every selected directory, but with the most
+// valuable first for when there's a deadline: profiles before caches (which
+// aren't resynced at all), then the most recently written. the ones not done
+// by the deadline are reported. returns how many were done
+size_t do_action_by_value(enum Action action, bool overlay)
+{
+        size_t total = 0, done = 0, n = 0;
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                total += CONFIG.browsers[i]->dirs_num;
+        }
+        struct Valued *dirs = calloc(total + 1, sizeof(struct Valued));
+
+        if (dirs == NULL) {
+                plog(LOG_ERROR, "failed ordering directories");
+                return 0;
+        }
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+
+                        if (!dir->selected) {
+                                continue;
                         }
-                        continue;
+                        dirs[n].dir = dir;
+                        dirs[n].written = (dir->type == DIR_PROFILE) ?
+                                                  last_written(dir, overlay) :
+                                                  0;
+                        n++;
                 }
+        }
+        qsort(dirs, n, sizeof(struct Valued), compare_value);
 
-                // attempt to repair state if previous/current
-                // sync session is corrupted
-                if (repair_state(dir, backup, tmpfs, overlay) == -1) {
-                        plog(LOG_WARN,
-                             "failed checking state of previous sync session for %s",
-                             dir->path);
-                        continue;
+        for (size_t i = 0; i < n; i++) {
+                if (deadline_left() == 0 ||
+                    (action == ACTION_RESYNC && lock_cancelled())) {
+                        break;
                 }
+                // caches can be thrown away, their backups are used as
+                // they are
+                if (do_action_on_dir(dirs[i].dir, action, overlay, true) ==
+                    0) {
+                        dirs[i].result = VALUE_DONE;
+                        done++;
+                } else if (deadline_left() != 0) {
+                        dirs[i].result = VALUE_FAILED;
+                }
+        }
 
-                // perform action
-                if (action == ACTION_SYNC) {
-                        err = sync_dir(dir, backup, tmpfs, overlay);
-                } else if (action == ACTION_UNSYNC) {
-                        err = unsync_dir(dir, backup, tmpfs, otmpfs, overlay);
-                } else if (action == ACTION_RESYNC) {
-                        err = resync_dir(dir, backup, tmpfs, otmpfs, overlay);
+        for (size_t i = 0; i < n; i++) {
+                struct Dir *dir = dirs[i].dir;
+
+                if (dirs[i].result == VALUE_PENDING) {
+                        plog(LOG_WARN, "%s was not flushed before the deadline",
+                             dir->path);
+                } else if (dirs[i].result == VALUE_FAILED) {
+                        plog(LOG_WARN, "%s was not flushed", dir->path);
+                } else if (dir->type == DIR_CACHE &&
+                           CONFIG.resync_cache && !cache_ephemeral(dir)) {
+                        plog(LOG_INFO, "changes to cache %s were not flushed",
+                             dir->path);
                 }
-                if (err == -1) {
-                        plog(LOG_WARN, "failed %sing directory %s",
-                             action_str[action], dir->path);
-                        continue;
+        }
+        free(dirs);
+
+        return done;
+}
+
+// perform action on a single directory, skip_caches leaves caches out of
+// resyncing
+int do_action_on_dir(struct Dir *dir, enum Action action, bool overlay,
+                     bool skip_caches)
+{
+        char backup[PATH_MAX], tmpfs[PATH_MAX], otmpfs[PATH_MAX];
+        int err = 0;
+
+        flush = (struct Flush){ 0 };
+
+        if (!directory_is_safe(dir)) {
+                plog(LOG_WARN, "directory %s is unsafe, skipping", dir->path);
+                return -1;
+        }
+
+        // get required paths
+        if (get_paths(dir, backup, tmpfs) == -1) {
+                plog(LOG_WARN, "failed getting required paths for %s",
+                     dir->path);
+                return -1;
+        }
+#ifndef NOOVERLAY
+        if ((action == ACTION_UNSYNC || action == ACTION_RESYNC ||
+             action == ACTION_ROLLBACK || action == ACTION_DETACH) &&
+            overlay && get_overlay_paths(dir, otmpfs) == -1) {
+                plog(LOG_WARN, "failed getting overlay path for %s",
+                     dir->path);
+                return -1;
+        }
+        struct stat sb;
+
+        // placeholders left by a hydrator that is gone are filled in
+        // (or we give up) before anything points to them again
+        if (!overlay && DIREXISTS(tmpfs) &&
+            hydrate_orphans(tmpfs, backup) == -1) {
+                plog(LOG_ERROR, "failed filling in placeholders left in %s",
+                     tmpfs);
+                return -1;
+        }
+#endif
+
+        // clear cache in tmpfs and backup
+        if (action == ACTION_RMCACHE && dir->type == DIR_CACHE) {
+                if (clear_cache(dir, backup, tmpfs) == -1) {
+                        plog(LOG_ERROR, "failed clearing cache for %s",
+                             dir->path);
+                        return -1;
                 }
-                did_something++;
+                return 0;
         }
 
-        return (did_something > 0) ? 0 : -1;
+        // detached directories that weren't touched since are
+        // adopted as they are, the rest are synced as usual
+        if (action == ACTION_ATTACH && state_is_current(dir, backup, tmpfs) &&
+            get_dir_state(dir, backup, tmpfs) != STATE_UNSYNCED) {
+                plog(LOG_INFO, "attaching directory %s", dir->path);
+                return 0;
+        }
+
+        // attempt to repair state if previous/current
+        // sync session is corrupted
+        if (repair_state(dir, backup, tmpfs, overlay) == -1) {
+                plog(LOG_WARN,
+                     "failed checking state of previous sync session for %s",
+                     dir->path);
+                return -1;
+        }
+
+        // perform action
+        if (action == ACTION_SYNC || action == ACTION_ATTACH) {
+                err = sync_dir(dir, backup, tmpfs, overlay);
+        } else if (action == ACTION_UNSYNC) {
+                err = unsync_dir(dir, backup, tmpfs, otmpfs, overlay,
+                                 skip_caches);
+        } else if (action == ACTION_RESYNC) {
+                err = resync_dir(dir, backup, tmpfs, otmpfs, overlay, false,
+                                 skip_caches);
+        } else if (action == ACTION_ROLLBACK) {
+                err = rollback_dir(dir, backup, tmpfs, otmpfs, overlay,
+                                   skip_caches);
+        } else if (action == ACTION_DETACH) {
+                err = detach_dir(dir, backup, tmpfs, otmpfs, overlay,
+                                 skip_caches);
+        }
+        if (err == -1) {
+                plog(LOG_WARN, "failed %sing directory %s", action_str[action],
+                     dir->path);
+                forget_state(dir);
+                return -1;
+        }
+#ifndef NOOVERLAY
+        // backup is in place now, so placeholders can be filled in from it
+        if ((action == ACTION_SYNC || action == ACTION_ATTACH) && !overlay &&
+            lazy_syncing() && DIREXISTS(tmpfs) && DIREXISTS(backup) &&
+            release_placeholders(tmpfs, backup) == -1) {
+                plog(LOG_WARN, "failed releasing placeholders of %s", tmpfs);
+                PERROR();
+        }
+#endif
+        if (record_state(dir, backup, tmpfs,
+                         (flush.at != 0) ? &flush : NULL) == -1) {
+                plog(LOG_WARN, "failed recording state of %s", dir->path);
+                PERROR();
+        }
+
+        return 0;
 }
 
 // if overlay is true then don't copy to tmpfs
@@ -138,6 +329,7 @@ static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
         bool did_something = false;
 
         plog(LOG_INFO, "syncing directory %s", dir->path);
+        flush.at = time(NULL);
 
         // if backup exists but dir doesnt, then move backup to dir location
         if (DIREXISTS(backup) && !DIREXISTS(dir->path)) {
@@ -148,9 +340,22 @@ static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
                 }
         }
 
-        // copy dir to tmpfs if we are not mounted (overlay)
-        if (!overlay && !DIREXISTS(tmpfs)) {
-                if (copy_path(dir->path, tmpfs, false) == -1) {
+        // copy dir to tmpfs if we are not mounted (overlay),
+        // if lazy then files are filled in from backup on first access.
+        // an interrupted copy is resumed. ephemeral caches start (nearly)
+        // empty instead
+        char src[PATH_MAX];
+
+        if (!overlay && cache_ephemeral(dir) && !DIREXISTS(tmpfs)) {
+                if (seed_tmpfs(dir, dir->path, tmpfs) == -1) {
+                        plog(LOG_ERROR, "failed seeding tmpfs");
+                        PERROR();
+                        return -1;
+                }
+                did_something = true;
+        } else if (!overlay &&
+                   (!DIREXISTS(tmpfs) || journal_incomplete(tmpfs, src))) {
+                if (copy_to_tmpfs(dir, dir->path, tmpfs, backup) == -1) {
                         plog(LOG_ERROR, "failed syncing dir to tmpfs");
                         PERROR();
                         return -1;
@@ -160,7 +365,15 @@ static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
 
         if (DIREXISTS(dir->path) && !LEXISTS(backup)) {
                 // temporary path to swap with dir
-                char tmp_path[PATH_MAX];
+                char tmp_path[PATH_MAX], root[PATH_MAX];
+
+                snprintf(root, PATH_MAX, "%s", backup);
+
+                if (create_dir(dirname(root), 0700) == -1) {
+                        plog(LOG_ERROR, "failed creating backup root");
+                        PERROR();
+                        return -1;
+                }
 
                 create_unique_path(tmp_path, PATH_MAX, dir->path, 0);
 
@@ -186,9 +399,18 @@ static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
                         return -1;
                 }
                 // update tmpfs in case backup was modified after copy,
-                // only if browser is running
-                if (!overlay && get_pid(dir->browser->procname) >= 0) {
-                        if (copy_path(backup, tmpfs, false) == -1) {
+                // only if browser is running (placeholders are filled
+                // in from backup so they are up to date anyways)
+                if (!overlay && !lazy_syncing() && !cache_ephemeral(dir) &&
+                    get_pid(dir->browser->procname) >= 0) {
+                        int err = set_exclude_filter(dir, backup);
+
+                        if (err == 0) {
+                                err = copy_path(backup, tmpfs, false);
+                        }
+                        clear_policy_filter();
+
+                        if (err == -1) {
                                 plog(LOG_ERROR,
                                      "failed syncing tmpfs with backup");
                                 PERROR();
@@ -207,7 +429,7 @@ static int sync_dir(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
 
 // automatically resyncs directory
 static int unsync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
-                      bool overlay)
+                      bool overlay, bool skip_caches)
 {
         struct stat sb;
         plog(LOG_INFO, "unsyncing directory %s", dir->path);
@@ -219,7 +441,8 @@ static int unsync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
         }
         if (DIREXISTS(tmpfs)) {
                 // sync backup if tmpfs exists
-                if (resync_dir(dir, backup, tmpfs, otmpfs, overlay) == -1) {
+                if (resync_dir(dir, backup, tmpfs, otmpfs, overlay, true,
+                               skip_caches) == -1) {
                         plog(LOG_ERROR, "failed resyncing");
                         return -1;
                 }
@@ -232,10 +455,26 @@ static int unsync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
                 PERROR();
                 return -1;
         }
+        remove_backup_root(backup);
+        remove_snapshot(backup);
+        // what was written to ephemeral caches is thrown away
+        if (dir->type == DIR_CACHE && CONFIG.cache_mode == CACHE_DISCARD &&
+            clear_dir(dir->path) == -1) {
+                plog(LOG_WARN, "failed clearing cache %s", dir->path);
+                PERROR();
+        }
         // update dir in case tmpfs was modified after copy,
-        // only if browser is running
-        if (DIREXISTS(tmpfs) && get_pid(dir->browser->procname) >= 0) {
-                if (copy_path(tmpfs, dir->path, false) == -1) {
+        // only if browser is running. same as the last resync
+        if (DIREXISTS(tmpfs) && !cache_ephemeral(dir) &&
+            get_pid(dir->browser->procname) >= 0) {
+                int err = set_policy_filter(dir, tmpfs, true);
+
+                if (err == 0) {
+                        err = copy_path(tmpfs, dir->path, false);
+                }
+                clear_policy_filter();
+
+                if (err == -1) {
                         plog(LOG_ERROR, "failed syncing dir with tmpfs");
                         PERROR();
                         return -1;
@@ -249,20 +488,25 @@ static int unsync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
                 PERROR();
                 return -1;
         }
+        journal_finish(tmpfs);
 
         return 0;
 }
 
+// final means the overlay won't be used for this dir after resyncing
 static int resync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
-                      bool overlay)
+                      bool overlay, bool final, bool skip_caches)
 {
-        if (!CONFIG.resync_cache && dir->type == DIR_CACHE) {
+        if (!dir_resynced(dir) || (skip_caches && dir->type == DIR_CACHE)) {
                 return 0;
         }
 
         struct stat sb;
 
         plog(LOG_INFO, "resyncing directory %s", dir->path);
+        // anything written from now on may be missed
+        flush.at = time(NULL);
+        flush.resync = true;
 
         if (!DIREXISTS(tmpfs)) {
                 plog(LOG_ERROR, "%s does not exist", tmpfs);
@@ -274,17 +518,78 @@ static int resync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
                 return -1;
         }
         char *tmp = (overlay) ? otmpfs : tmpfs;
-        bool do_sync = true;
 
         // dont resync if otmpfs doesn't exist (means there arent any changes)
         if (overlay && !DIREXISTS(otmpfs)) {
-                do_sync = false;
+                return 0;
+        }
+        plog(LOG_DEBUG, "syncing tmpfs %s to backup", tmp);
+
+        // not fatal, the backup itself is still fine
+        if (CONFIG.snapshot_backups && DIREXISTS(backup) &&
+            snapshot_backup(backup) == -1) {
+                plog(LOG_WARN, "failed taking snapshot of %s", backup);
+        }
+
+        // leaves out what isn't due according to the browser's policies
+        if (set_policy_filter(dir, tmp, final) == -1) {
+                plog(LOG_ERROR, "failed applying policies of %s", dir->path);
+                return -1;
+        }
+        int err = 0;
+
+#ifndef NOOVERLAY
+        // upper dir has whiteouts and xattrs that rsync doesn't understand
+        if (overlay) {
+                err = merge_overlay(otmpfs, tmpfs, backup,
+                                    final ? MERGE_FINAL : 0);
+                flush.avoided = merge_writes_avoided();
+
+                // compare against what the overlay actually falls through
+                // to, which may be an image made before this merge (only
+                // for the default backup root)
+                char olower[PATH_MAX];
+                size_t blen = strlen(PATHS.backups);
+
+                if (strncmp(backup, PATHS.backups, blen) == 0 &&
+                    backup[blen] == '/') {
+                        snprintf(olower, PATH_MAX, "%s%s",
+                                 PATHS.overlay_lower, backup + blen);
+                } else {
+                        snprintf(olower, PATH_MAX, "%s", backup);
+                }
+
+                // not needed if the upper dir is going to be cleared anyways.
+                // a running browser could keep writing to files that are
+                // moved out of the upper dir, so those writes would be lost
+                if (err == 0 && CONFIG.compact_overlay &&
+                    !CONFIG.reset_overlay &&
+                    get_pid(dir->browser->procname) < 0 &&
+                    compact_overlay(otmpfs, tmpfs, olower) == -1) {
+                        plog(LOG_WARN, "failed compacting %s", otmpfs);
+                }
         } else {
-                plog(LOG_DEBUG, "syncing tmpfs %s to backup", tmp);
+                err = resync_tmpfs(tmp, backup);
         }
+#else
+        err = resync_tmpfs(tmp, backup);
+#endif
+        clear_policy_filter();
 
-        if (do_sync && copy_path(tmp, backup, false) == -1) {
-                plog(LOG_ERROR, "failed syncing %s with %s", tmpfs, backup);
+        if (err == -1) {
+                plog(LOG_ERROR, "failed syncing %s with %s", tmp, backup);
+                PERROR();
+                return -1;
+        }
+
+        // not fatal either, the resync itself went through
+        if (generations_enabled() && create_generation(backup) == -1) {
+                plog(LOG_WARN, "failed creating generation of %s", backup);
+                PERROR();
+        }
+        // before the state says that it's backed up
+        if (CONFIG.durable_resync && sync_filesystem(backup) == -1) {
+                plog(LOG_ERROR, "failed flushing %s to disk", backup);
                 PERROR();
                 return -1;
         }
@@ -292,9 +597,310 @@ static int resync_dir(struct Dir *dir, char *backup, char *tmpfs, char *otmpfs,
         return 0;
 }
 
+// resync dir and leave it in place for the next attach. there won't be
+// anything to fill in placeholders while detached, so they are filled in now
+static int detach_dir(struct Dir *dir, char *backup, char *tmpfs,
+                      char *otmpfs, bool overlay, bool skip_caches)
+{
+        struct stat sb;
+
+        if (!SYMEXISTS(dir->path)) {
+                return 0;
+        }
+        plog(LOG_INFO, "detaching directory %s", dir->path);
+
+        if (resync_dir(dir, backup, tmpfs, otmpfs, overlay, false,
+                       skip_caches) == -1) {
+                return -1;
+        }
 #ifndef NOOVERLAY
-// remount overlay in order to clear upper dir in an atomic way
-// a normal resync should be done before this this
+        if (CONFIG.lazy_sync && !overlay && hydrate_tree(tmpfs, backup) == -1) {
+                plog(LOG_ERROR, "failed filling in placeholders of %s", tmpfs);
+                return -1;
+        }
+#endif
+
+        return 0;
+}
+
+void set_rollback_generation(const char *name)
+{
+        snprintf(rollback_generation, PATH_MAX, "%s", name);
+}
+
+// restore backup (and tmpfs) from the snapshot taken before the last resync,
+// or from the generation set with set_rollback_generation().
+// with overlay, dirs without either are resynced instead so that their
+// changes survive the remount that clears the upper dir afterwards
+static int rollback_dir(struct Dir *dir, char *backup, char *tmpfs,
+                        char *otmpfs, bool overlay, bool skip_caches)
+{
+        struct stat sb;
+        char source[PATH_MAX], clone[PATH_MAX];
+        bool use_generation = (rollback_generation[0] != 0);
+
+        flush.at = time(NULL);
+
+        if (!SYMEXISTS(dir->path) || !DIREXISTS(backup)) {
+                plog(LOG_WARN, "%s is not synced, cannot roll back",
+                     dir->path);
+                return -1;
+        }
+        if (get_pid(dir->browser->procname) >= 0) {
+                plog(LOG_ERROR, "browser %s is running, cannot roll back",
+                     dir->browser->name);
+                return -1;
+        }
+        if (use_generation) {
+                char generations[PATH_MAX];
+
+                get_history_path(backup, PATHS.generations,
+                                 GENERATION_ROOT_NAME, generations);
+                snprintf(source, PATH_MAX, "%s/%s", generations,
+                         rollback_generation);
+        } else {
+                get_snapshot_path(backup, source);
+        }
+
+        if (!DIREXISTS(source)) {
+                plog(LOG_WARN, "no %s of %s to roll back to",
+                     use_generation ? "such generation" : "snapshot",
+                     dir->path);
+                return (overlay) ? resync_dir(dir, backup, tmpfs, otmpfs,
+                                              overlay, false, skip_caches) :
+                                   -1;
+        }
+        plog(LOG_INFO, "rolling back directory %s", dir->path);
+
+        if (use_generation) {
+                if (restore_generation(backup, rollback_generation) == -1) {
+                        plog(LOG_ERROR, "failed restoring %s from generation",
+                             backup);
+                        PERROR();
+                        return -1;
+                }
+        } else {
+                // restore a clone of the snapshot so that it is kept around
+                create_unique_path(clone, PATH_MAX, backup, 0);
+
+                if (clone_path(source, clone, 0) == -1 ||
+                    replace_paths(backup, clone) == -1) {
+                        plog(LOG_ERROR, "failed restoring %s from snapshot",
+                             backup);
+                        PERROR();
+                        if (LEXISTS(clone)) {
+                                remove_path(clone);
+                        }
+                        return -1;
+                }
+        }
+
+        // overlay picks the backup up once it is remounted
+        if (overlay) {
+                return 0;
+        }
+        char new_tmpfs[PATH_MAX];
+
+        create_unique_path(new_tmpfs, PATH_MAX, tmpfs, 0);
+
+        int err = set_exclude_filter(dir, backup);
+
+        if (err == 0) {
+                err = copy_path(backup, new_tmpfs, false);
+        }
+        if (err == 0 && CONFIG.exclude_mode == EXCLUDE_DISK) {
+                err = link_excluded(backup, new_tmpfs, backup);
+        }
+        clear_policy_filter();
+
+        if (err == -1 || replace_paths(tmpfs, new_tmpfs) == -1) {
+                plog(LOG_ERROR, "failed restoring tmpfs from backup");
+                PERROR();
+                if (LEXISTS(new_tmpfs)) {
+                        remove_path(new_tmpfs);
+                }
+                return -1;
+        }
+
+        return 0;
+}
+
+// if lazy, only create placeholders that are filled in from backup.
+// the copy is journaled, so that an interrupted one is resumed.
+// excluded files are left out, and linked to backup if they stay on disk
+static int copy_to_tmpfs(struct Dir *dir, const char *src, const char *tmpfs,
+                         const char *backup)
+{
+        if (set_exclude_filter(dir, src) == -1) {
+                return -1;
+        }
+        int err = 0;
+
+#ifndef NOOVERLAY
+        if (hydrator_started()) {
+                struct stat sb;
+
+                // placeholders are quick to make, so just start over
+                if ((DIREXISTS(tmpfs) && remove_dir(tmpfs) == -1) ||
+                    journal_begin(tmpfs, src) == -1 ||
+                    create_placeholders(src, tmpfs) == -1 ||
+                    journal_finish(tmpfs) == -1) {
+                        err = -1;
+                }
+        } else {
+                err = copy_journaled(src, tmpfs);
+        }
+#else
+        err = copy_journaled(src, tmpfs);
+#endif
+        if (err == 0 && CONFIG.exclude_mode == EXCLUDE_DISK) {
+                err = link_excluded(src, tmpfs, backup);
+        }
+        clear_policy_filter();
+
+        return err;
+}
+
+// point what the copy filter excluded from src in tmpfs to its counterpart
+// in backup, which may not exist yet
+static int link_excluded(const char *src, const char *tmpfs,
+                         const char *backup)
+{
+        walk_src = src;
+        walk_tmpfs = tmpfs;
+        walk_backup = backup;
+
+        return nftw(src, link_entry, MAX_FD, FTW_PHYS | FTW_ACTIONRETVAL);
+}
+
+static int link_entry(const char *fpath, const struct stat *UNUSED(sb),
+                      int typeflag, struct FTW *UNUSED(ftwbuf))
+{
+        if (!copy_skips(fpath)) {
+                return FTW_CONTINUE;
+        }
+        struct stat sb;
+        const char *rel = fpath + strlen(walk_src);
+        char link[PATH_MAX], target[PATH_MAX];
+
+        snprintf(link, PATH_MAX, "%s%s", walk_tmpfs, rel);
+        snprintf(target, PATH_MAX, "%s%s", walk_backup, rel);
+
+        // left from a copy that was interrupted
+        if (!LEXISTS(link) && symlink(target, link) == -1) {
+                return -1;
+        }
+
+        return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+}
+
+// create tmpfs with only the files of src that match the seeds of dir, so
+// that it doesn't take longer with the size of src. it's not journaled,
+// a cache that's missing some of them is still fine
+static int seed_tmpfs(struct Dir *dir, const char *src, const char *tmpfs)
+{
+        struct Browser *browser = dir->browser;
+        bool seeded = false;
+
+        if (create_dir(tmpfs, 0700) == -1) {
+                return -1;
+        }
+        for (size_t i = 0; i < browser->policies_num && !seeded; i++) {
+                seeded = (browser->policies[i].class == POLICY_SEED);
+        }
+        if (seeded) {
+                if (set_exclude_filter(dir, src) == -1) {
+                        return -1;
+                }
+                walk_src = src;
+                walk_tmpfs = tmpfs;
+                walk_dir = dir;
+
+                int err = nftw(src, seed_entry, MAX_FD,
+                               FTW_PHYS | FTW_ACTIONRETVAL);
+
+                clear_policy_filter();
+
+                if (err == -1) {
+                        return -1;
+                }
+        }
+
+        return copy_metadata(src, tmpfs);
+}
+
+static int seed_entry(const char *fpath, const struct stat *sb, int typeflag,
+                      struct FTW *UNUSED(ftwbuf))
+{
+        if (copy_skips(fpath)) {
+                return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+        }
+        if (!S_ISREG(sb->st_mode)) {
+                return FTW_CONTINUE;
+        }
+        struct Browser *browser = walk_dir->browser;
+
+        for (size_t i = 0; i < browser->policies_num; i++) {
+                struct Policy *policy = &browser->policies[i];
+
+                if (policy->class != POLICY_SEED ||
+                    !path_matches(walk_src, fpath, policy->glob)) {
+                        continue;
+                }
+                char dest[PATH_MAX], parent[PATH_MAX];
+
+                snprintf(dest, PATH_MAX, "%s%s", walk_tmpfs,
+                         fpath + strlen(walk_src));
+                snprintf(parent, PATH_MAX, "%s", dest);
+
+                if (create_dir(dirname(parent), 0700) == -1 ||
+                    copy_file(fpath, dest) == -1) {
+                        return -1;
+                }
+                break;
+        }
+
+        return FTW_CONTINUE;
+}
+
+// caches that start empty and are thrown away when unsyncing
+bool cache_ephemeral(struct Dir *dir)
+{
+        return dir->type == DIR_CACHE && CONFIG.cache_mode != CACHE_COPY;
+}
+
+// false for caches that are not resynced (or only thrown away)
+bool dir_resynced(struct Dir *dir)
+{
+        return dir->type != DIR_CACHE ||
+               (CONFIG.resync_cache && CONFIG.cache_mode == CACHE_COPY);
+}
+
+// rsync would read placeholders as zeroes, so fill them in first
+static int resync_tmpfs(const char *tmpfs, const char *backup)
+{
+#ifndef NOOVERLAY
+        if (CONFIG.lazy_sync && hydrate_tree(tmpfs, backup) == -1) {
+                plog(LOG_ERROR, "failed filling in placeholders of %s", tmpfs);
+                return -1;
+        }
+#endif
+        return copy_path(tmpfs, backup, false);
+}
+
+static bool lazy_syncing(void)
+{
+#ifndef NOOVERLAY
+        return hydrator_started();
+#else
+        return false;
+#endif
+}
+
+#ifndef NOOVERLAY
+// replace overlay with a fresh one in order to clear upper dir, without
+// browsers ever being pointed away from the overlay.
+// a normal resync should be done before this
 int reset_overlay(void)
 {
         plog(LOG_INFO, "resetting overlay");
@@ -304,6 +910,49 @@ int reset_overlay(void)
                 return -1;
         }
 
+        if (mount_standby_overlay() == -1) {
+                plog(LOG_WARN, "failed mounting standby overlay, remounting "
+                               "overlay instead");
+                return remount_overlay();
+        }
+
+        if (repoint_dirs("standby") == -1) {
+                plog(LOG_ERROR,
+                     "failed repointing symlinks to standby overlay");
+                return -1;
+        }
+
+        // catch changes made since the resync, before the switch.
+        // changes are small so the standby overlay (which has the same
+        // lowerdir) shouldn't have any of it cached yet. if lowerdir is an
+        // image, they are merged into the standby overlay itself as well
+        if (merge_overlay_dirs() == -1) {
+                plog(LOG_WARN, "failed merging some directories");
+        }
+
+        if (swap_standby_overlay() == -1) {
+                plog(LOG_ERROR, "failed replacing overlay with standby");
+                return -1;
+        }
+
+        if (repoint_dirs("tmpfs") == -1) {
+                plog(LOG_ERROR,
+                     "failed repointing symlinks to respective tmpfs'");
+                return -1;
+        }
+
+        if (release_standby_overlay() == -1) {
+                plog(LOG_ERROR, "failed releasing standby overlay");
+                return -1;
+        }
+
+        return 0;
+}
+
+// remount overlay in order to clear upper dir, browsers write to
+// the backups directly in the meantime
+int remount_overlay(void)
+{
         if (repoint_dirs("backup") == -1) {
                 plog(LOG_ERROR,
                      "failed repointing symlinks to respective backups");
@@ -329,15 +978,152 @@ int reset_overlay(void)
         return 0;
 }
 
-// make all directory symlinks point to backup or tmpfs in an atomic way
-static int repoint_dirs(const char *target)
+// merge upper dir of every synced directory into its backup, and into the
+// standby overlay if it doesn't see the backups directly
+static int merge_overlay_dirs(void)
 {
         struct stat sb;
+        char backup[PATH_MAX], tmpfs[PATH_MAX], otmpfs[PATH_MAX];
+        char standby[PATH_MAX];
+        int err = 0;
 
-        char backup[PATH_MAX], tmpfs[PATH_MAX];
-        const char *path = (strcmp(target, "tmpfs") == 0)  ? tmpfs :
-                           (strcmp(target, "backup") == 0) ? backup :
-                                                             NULL;
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        struct Dir *dir = browser->dirs[k];
+
+                        if (!SYMEXISTS(dir->path) || !dir_resynced(dir)) {
+                                continue;
+                        }
+                        if (get_paths(dir, backup, tmpfs) == -1 ||
+                            get_overlay_paths(dir, otmpfs) == -1) {
+                                err = -1;
+                                continue;
+                        }
+                        // excluded files are dropped with the upper dir
+                        if (!DIREXISTS(otmpfs)) {
+                                continue;
+                        }
+                        if (set_exclude_filter(dir, otmpfs) == -1) {
+                                err = -1;
+                                continue;
+                        }
+                        if (merge_overlay(otmpfs, tmpfs, backup,
+                                          MERGE_FINAL) == -1) {
+                                err = -1;
+                        }
+                        // browser may have written to it already
+                        snprintf(standby, PATH_MAX, "%s%s",
+                                 PATHS.standby_tmpfs,
+                                 tmpfs + strlen(PATHS.tmpfs));
+
+                        if (overlay_lower_is_image() &&
+                            merge_overlay(otmpfs, tmpfs, standby,
+                                          MERGE_FINAL | MERGE_KEEP_NEWER) ==
+                                    -1) {
+                                err = -1;
+                        }
+                        clear_policy_filter();
+                }
+        }
+
+        return err;
+}
+
+// merge upper dirs of old overlays that were kept because files were still
+// open on them, once they aren't anymore (or anyways if force is set), and
+// reclaim them. what was merged before is older than the backups by now
+int reclaim_overlays(bool force)
+{
+        struct stat sb;
+        DIR *dp = opendir(PATHS.overlay_retired);
+        struct dirent *de = NULL;
+        int err = 0;
+
+        if (dp == NULL) {
+                return (errno == ENOENT) ? 0 : -1;
+        }
+        char retired[PATH_MAX], rupper[PATH_MAX * 2];
+        char backup[PATH_MAX], tmpfs[PATH_MAX], otmpfs[PATH_MAX];
+
+        while ((de = readdir(dp)) != NULL) {
+                if (name_is_dot(de->d_name)) {
+                        continue;
+                }
+                snprintf(retired, PATH_MAX, "%s/%s", PATHS.overlay_retired,
+                         de->d_name);
+
+                if (!force && retired_overlay_in_use(retired)) {
+                        continue;
+                }
+                plog(LOG_INFO, "merging upper dir of old overlay %s",
+                     de->d_name);
+                int merr = 0;
+
+                for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                        struct Browser *browser = CONFIG.browsers[i];
+
+                        for (size_t k = 0; k < browser->dirs_num; k++) {
+                                struct Dir *dir = browser->dirs[k];
+
+                                if (!SYMEXISTS(dir->path) ||
+                                    !dir_resynced(dir)) {
+                                        continue;
+                                }
+                                if (get_paths(dir, backup, tmpfs) == -1 ||
+                                    get_overlay_paths(dir, otmpfs) == -1) {
+                                        merr = -1;
+                                        continue;
+                                }
+                                snprintf(rupper, sizeof(rupper), "%s/upper%s",
+                                         retired,
+                                         otmpfs + strlen(PATHS.overlay_upper));
+
+                                if (!DIREXISTS(rupper)) {
+                                        continue;
+                                }
+                                if (set_exclude_filter(dir, rupper) == -1) {
+                                        merr = -1;
+                                        continue;
+                                }
+                                // the current overlay stands in for the gone
+                                // one where the merge needs to look through
+                                if (merge_overlay(rupper, tmpfs, backup,
+                                                  MERGE_FINAL |
+                                                          MERGE_KEEP_NEWER) ==
+                                    -1) {
+                                        merr = -1;
+                                }
+                                clear_policy_filter();
+                        }
+                }
+                if (merr == -1) {
+                        plog(LOG_WARN, "failed merging %s, keeping it",
+                             retired);
+                        err = -1;
+                } else if (remove_retired_overlay(retired) == -1) {
+                        plog(LOG_WARN, "failed removing %s", retired);
+                        PERROR();
+                        err = -1;
+                }
+        }
+        closedir(dp);
+
+        return err;
+}
+
+// make all directory symlinks point to backup, tmpfs or
+// standby overlay in an atomic way
+int repoint_dirs(const char *target)
+{
+        struct stat sb;
+
+        char backup[PATH_MAX], tmpfs[PATH_MAX], standby[PATH_MAX];
+        const char *path = (strcmp(target, "tmpfs") == 0)   ? tmpfs :
+                           (strcmp(target, "backup") == 0)  ? backup :
+                           (strcmp(target, "standby") == 0) ? standby :
+                                                              NULL;
 
         if (path == NULL) {
                 return -1;
@@ -361,6 +1147,9 @@ static int repoint_dirs(const char *target)
                                      dir->path);
                                 continue;
                         }
+                        snprintf(standby, PATH_MAX, "%s%s",
+                                 PATHS.standby_tmpfs,
+                                 tmpfs + strlen(PATHS.tmpfs));
 
                         char tmp_path[PATH_MAX];
 
@@ -391,6 +1180,11 @@ static int repoint_dirs(const char *target)
                                 PERROR();
                                 continue;
                         }
+                        if (path == tmpfs &&
+                            refresh_state(dir, backup, tmpfs) == -1) {
+                                plog(LOG_WARN, "failed recording state of %s",
+                                     dir->path);
+                        }
                 }
         }
 
@@ -398,6 +1192,16 @@ static int repoint_dirs(const char *target)
 }
 #endif
 
+// true if the recorded state of dir can be trusted
+static bool state_is_current(struct Dir *dir, const char *backup,
+                             const char *tmpfs)
+{
+        char src[PATH_MAX];
+
+        return state_unchanged(dir, backup, tmpfs) &&
+               !journal_incomplete(tmpfs, src);
+}
+
 // should be run before any action.
 // repairs current session for directory or sends
 // directories that are alone as recovery directories.
@@ -405,16 +1209,37 @@ static int repair_state(struct Dir *dir, char *backup, char *tmpfs,
                         bool overlay)
 {
         struct stat sb;
+        char src[PATH_MAX];
+
+        // left consistent by the last action and not touched since
+        if (state_is_current(dir, backup, tmpfs)) {
+                return 0;
+        }
 
         if (DIREXISTS(dir->path)) {
                 // if dir exists, then assume we aren't synced
                 // any tmpfs or backup dirs are then converted into
-                // recovery dirs
+                // recovery dirs, unless tmpfs is from an interrupted sync
+                // which is resumed instead
+                bool resume = DIREXISTS(tmpfs) &&
+                              journal_incomplete(tmpfs, src) &&
+                              STR_EQUAL(src, dir->path);
+
+#ifndef NOOVERLAY
+                // placeholders are useless without the backup
+                if (CONFIG.lazy_sync && !resume && DIREXISTS(tmpfs) &&
+                    remove_placeholders(tmpfs) == -1) {
+                        plog(LOG_WARN, "failed removing placeholders");
+                }
+#endif
                 if (recover_path(dir, backup) == -1 ||
-                    recover_path(dir, tmpfs) == -1) {
+                    (!resume && recover_path(dir, tmpfs) == -1)) {
                         plog(LOG_ERROR, "failed recovering directories");
                         return -1;
                 }
+                if (!resume) {
+                        journal_finish(tmpfs);
+                }
         }
         if (fix_session(dir, backup, tmpfs, overlay) == -1) {
                 plog(LOG_ERROR, "failed checking state");
@@ -429,8 +1254,8 @@ static int fix_session(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
 {
         struct stat sb;
 
-        if (fix_backup(backup, tmpfs) == -1 ||
-            fix_tmpfs(backup, tmpfs, overlay) == -1) {
+        if (fix_backup(dir, backup, tmpfs) == -1 ||
+            fix_tmpfs(dir, backup, tmpfs, overlay) == -1) {
                 plog(LOG_ERROR, "failed fixing directories");
                 return -1;
         }
@@ -476,15 +1301,29 @@ check:
         return 0;
 }
 
-static int fix_backup(char *backup, char *tmpfs)
+static int fix_backup(struct Dir *dir, char *backup, char *tmpfs)
 {
         struct stat sb;
+        char src[PATH_MAX];
+
+        // a half copied tmpfs must not become the backup, if it's from an
+        // interrupted sync then that sync is resumed instead
+        if (DIREXISTS(tmpfs) && !DIREXISTS(backup) &&
+            journal_incomplete(tmpfs, src)) {
+                if (DIREXISTS(dir->path) && STR_EQUAL(src, dir->path)) {
+                        return 0;
+                }
+                plog(LOG_ERROR, "backup not found and tmpfs is incomplete "
+                                "(copied from %s)",
+                     src);
+                return -1;
+        }
         // create backup by copying tmpfs
         if (DIREXISTS(tmpfs) && !DIREXISTS(backup)) {
                 plog(LOG_INFO,
                      "backup not found, syncing tmpfs to backup location");
 
-                if (copy_path(tmpfs, backup, false) == -1) {
+                if (clone_path(tmpfs, backup, 0) == -1) {
                         plog(LOG_ERROR, "failed syncing tmpfs to backup");
                         PERROR();
                         return -1;
@@ -497,16 +1336,31 @@ static int fix_backup(char *backup, char *tmpfs)
         return 0;
 }
 
-static int fix_tmpfs(char *backup, char *tmpfs, bool overlay)
+static int fix_tmpfs(struct Dir *dir, char *backup, char *tmpfs, bool overlay)
 {
         struct stat sb;
+        char src[PATH_MAX];
 
-        // copy backup to tmpfs if it doesn't exist (only if no overlay)
-        if (!overlay_mounted() && DIREXISTS(backup) && !DIREXISTS(tmpfs)) {
-                plog(LOG_INFO,
-                     "tmpfs not found, syncing backup to tmpfs location");
+        // copy backup to tmpfs if it doesn't exist or wasn't copied
+        // completely (only if no overlay), ephemeral caches are seeded
+        if (!overlay_mounted() && DIREXISTS(backup) && !DIREXISTS(tmpfs) &&
+            cache_ephemeral(dir)) {
+                plog(LOG_INFO, "tmpfs not found, seeding it from backup");
 
-                if (copy_path(backup, tmpfs, false) == -1) {
+                if (seed_tmpfs(dir, backup, tmpfs) == -1) {
+                        plog(LOG_ERROR, "failed seeding tmpfs");
+                        PERROR();
+                        return -1;
+                }
+        } else if (!overlay_mounted() && DIREXISTS(backup) &&
+                   (!DIREXISTS(tmpfs) || journal_incomplete(tmpfs, src))) {
+                plog(LOG_INFO, DIREXISTS(tmpfs) ?
+                                       "tmpfs is incomplete, syncing backup "
+                                       "to tmpfs location" :
+                                       "tmpfs not found, syncing backup to "
+                                       "tmpfs location");
+
+                if (copy_to_tmpfs(dir, backup, tmpfs, backup) == -1) {
                         plog(LOG_ERROR, "failed syncing backup to tmpfs");
                         PERROR();
                         return -1;
@@ -556,7 +1410,8 @@ static int recover_path(struct Dir *sync_dir, const char *path)
         char recovery_path[PATH_MAX];
         char time_buf[100];
 
-        if (strftime(time_buf, 100, "%d-%m-%y_%H:%M:%S", time_info) != 0) {
+        // sortable, so that recovery dirs can be restored in order
+        if (strftime(time_buf, 100, "%Y-%m-%d_%H-%M-%S", time_info) != 0) {
                 snprintf(recovery_path, PATH_MAX,
                          "%s/" BOR_CRASH_PREFIX "%s_%s", parent_dir,
                          sync_dir->dirname, time_buf);
@@ -571,6 +1426,29 @@ static int recover_path(struct Dir *sync_dir, const char *path)
 
         create_unique_path(unique_path, PATH_MAX, recovery_path, 0);
 
+        // only save what differs from the directory, most of it is usually
+        // the same and path may be on the tmpfs
+        int saved = save_recovery(sync_dir, path, unique_path);
+
+        if (saved >= 0) {
+                if (saved == 0) {
+                        plog(LOG_INFO, "%s is the same as %s, removing it",
+                             path, sync_dir->path);
+                } else {
+                        plog(LOG_INFO, "saved %d differing files in %s",
+                             saved, unique_path);
+                }
+                if (remove_path(path) == -1) {
+                        plog(LOG_ERROR, "failed removing %s", path);
+                        PERROR();
+                        return -1;
+                }
+                return 0;
+        }
+        plog(LOG_WARN, "failed saving differing files of %s, saving all of it",
+             path);
+        PERROR();
+
         if (move_path(path, unique_path, false) == -1) {
                 plog(LOG_ERROR, "failed moving dir to %s", unique_path);
                 PERROR();
@@ -617,6 +1495,153 @@ static int clear_cache(struct Dir *dir, const char *backup, const char *tmpfs)
 
 // write backup and tmpfs path for dir in given buffers
 // buffers should be PATH_MAX in size
+// backups are kept on the same filesystem as their dir so that moving
+// between them is a rename. an existing backup is used wherever it is,
+// otherwise the topmost dir we can write to on that filesystem. only
+// what the user alone can write to is trusted with (or as) a backup
+static void get_backup_root(struct Dir *dir, const char *name, char *root)
+{
+        struct stat sb, psb;
+        char cur[PATH_MAX], path[PATH_MAX * 2], best[PATH_MAX] = { 0 };
+
+        snprintf(root, PATH_MAX, "%s", PATHS.backups);
+        snprintf(path, sizeof(path), "%s/%s", PATHS.backups, name);
+
+        if (LEXISTS(path)) {
+                return;
+        }
+        // backups may not have been created yet
+        snprintf(cur, PATH_MAX, "%s", PATHS.backups);
+
+        while (stat(cur, &sb) == -1) {
+                if (STR_EQUAL(cur, "/")) {
+                        return;
+                }
+                snprintf(path, sizeof(path), "%s", cur);
+                snprintf(cur, PATH_MAX, "%s", dirname(path));
+        }
+        snprintf(path, sizeof(path), "%s", dir->path);
+        snprintf(cur, PATH_MAX, "%s", dirname(path));
+
+        if (stat(cur, &psb) == -1 || psb.st_dev == sb.st_dev) {
+                return;
+        }
+
+        for (;;) {
+                bool top = STR_EQUAL(cur, "/");
+
+                char broot[PATH_MAX];
+
+                snprintf(broot, PATH_MAX, "%s/" BACKUP_ROOT_NAME,
+                         top ? "" : cur);
+                snprintf(path, sizeof(path), "%s/%s", broot, name);
+
+                bool safe = backup_root_is_safe(cur) &&
+                            (!LEXISTS(broot) || backup_root_is_safe(broot));
+
+                if (LEXISTS(path)) {
+                        if (safe && backup_root_is_safe(path)) {
+                                snprintf(best, PATH_MAX, "%s", cur);
+                                break;
+                        }
+                        plog(LOG_WARN, "ignoring unsafe backup %s", path);
+                }
+                // can't be part of lowerdir option of the overlay
+                if (safe && access(cur, W_OK) == 0 &&
+                    strpbrk(cur, ":,") == NULL) {
+                        snprintf(best, PATH_MAX, "%s", cur);
+                }
+                snprintf(path, sizeof(path), "%s", cur);
+                char *up = dirname(path);
+
+                if (top || stat(up, &sb) == -1 || sb.st_dev != psb.st_dev) {
+                        break;
+                }
+                snprintf(cur, PATH_MAX, "%s", up);
+        }
+
+        if (best[0] != 0) {
+                snprintf(root, PATH_MAX, "%s/" BACKUP_ROOT_NAME,
+                         STR_EQUAL(best, "/") ? "" : best);
+        }
+}
+
+// owned by the user and not writable by anyone else, so that nobody can
+// plant a backup (root) or swap it out
+static bool backup_root_is_safe(const char *path)
+{
+        struct stat sb;
+
+        return !file_has_bad_perms(path) && lstat(path, &sb) == 0 &&
+               (sb.st_mode & (S_IWGRP | S_IWOTH | S_ISVTX)) == 0;
+}
+
+// collect the backup roots used besides the default one
+void init_backup_roots(void)
+{
+        char backup[PATH_MAX], tmpfs[PATH_MAX];
+        size_t len = 0;
+
+        PATHS.backup_roots[0] = 0;
+
+        for (size_t i = 0; i < CONFIG.browsers_num; i++) {
+                struct Browser *browser = CONFIG.browsers[i];
+
+                for (size_t k = 0; k < browser->dirs_num; k++) {
+                        if (get_paths(browser->dirs[k], backup, tmpfs) == -1) {
+                                continue;
+                        }
+                        char *root = dirname(backup);
+
+                        if (STR_EQUAL(root, PATHS.backups) ||
+                            has_backup_root(root)) {
+                                continue;
+                        }
+                        len += snprintf(PATHS.backup_roots + len,
+                                        sizeof(PATHS.backup_roots) - len,
+                                        "%s%s", (len > 0) ? ":" : "", root);
+
+                        if (len >= sizeof(PATHS.backup_roots)) {
+                                plog(LOG_WARN, "too many backup roots");
+                                return;
+                        }
+                }
+        }
+}
+
+static bool has_backup_root(const char *root)
+{
+        size_t len = strlen(root);
+
+        for (const char *p = PATHS.backup_roots; *p != 0;) {
+                if (strncmp(p, root, len) == 0 &&
+                    (p[len] == ':' || p[len] == 0)) {
+                        return true;
+                }
+                p += strcspn(p, ":");
+                p += (*p == ':');
+        }
+
+        return false;
+}
+
+// true if moving dir to its backup falls back to copying
+bool backup_is_remote(struct Dir *dir, const char *backup)
+{
+        struct stat sb, rsb;
+        char path[PATH_MAX];
+
+        snprintf(path, PATH_MAX, "%s", dir->path);
+
+        if (stat(dirname(path), &sb) == -1) {
+                return false;
+        }
+        snprintf(path, PATH_MAX, "%s", backup);
+
+        // roots are created on the same filesystem when needed
+        return stat(dirname(path), &rsb) == 0 && rsb.st_dev != sb.st_dev;
+}
+
 int get_paths(struct Dir *dir, char *backup, char *tmpfs)
 {
         // generate hash from path of dir to prevent filename conflicts
@@ -631,9 +1656,13 @@ int get_paths(struct Dir *dir, char *backup, char *tmpfs)
         plog(LOG_DEBUG, "using dirname %s_%s for %s", hash, dir->dirname,
              dir->path);
 
-        snprintf(backup, PATH_MAX, "%s/%s_%s", PATHS.backups, hash,
-                 dir->dirname);
-        snprintf(tmpfs, PATH_MAX, "%s/%s_%s", PATHS.tmpfs, hash, dir->dirname);
+        char name[PATH_MAX], root[PATH_MAX];
+
+        snprintf(name, PATH_MAX, "%s_%s", hash, dir->dirname);
+        get_backup_root(dir, name, root);
+
+        snprintf(backup, PATH_MAX, "%s/%s", root, name);
+        snprintf(tmpfs, PATH_MAX, "%s/%s", PATHS.tmpfs, name);
 
         return 0;
 }
@@ -660,8 +1689,157 @@ int get_overlay_paths(struct Dir *dir, char *tmpfs)
 }
 #endif
 
+// remove root of backup if it's not the default one and nothing else is in it
+static void remove_backup_root(const char *backup)
+{
+        char path[PATH_MAX];
+
+        snprintf(path, PATH_MAX, "%s", backup);
+        char *root = dirname(path);
+
+        if (!STR_EQUAL(root, PATHS.backups) && rmdir(root) == -1 &&
+            errno != ENOTEMPTY && errno != EEXIST) {
+                plog(LOG_DEBUG, "failed removing backup root %s", root);
+        }
+}
+
+// history of a backup (snapshots, generations) lives in default_root for
+// the default backup root, and in root_name beside other backup roots, so
+// that it's always on the same filesystem as the backup
+void get_history_path(const char *backup, const char *default_root,
+                      const char *root_name, char *path)
+{
+        char tmp[PATH_MAX], name[PATH_MAX];
+
+        snprintf(tmp, PATH_MAX, "%s", backup);
+        snprintf(name, PATH_MAX, "%s", basename(tmp));
+        char *root = dirname(tmp);
+
+        if (STR_EQUAL(root, PATHS.backups)) {
+                snprintf(path, PATH_MAX, "%s/%s", default_root, name);
+        } else {
+                snprintf(path, PATH_MAX, "%s/%s/%s", dirname(root), root_name,
+                         name);
+        }
+}
+
+static void get_snapshot_path(const char *backup, char *snapshot)
+{
+        get_history_path(backup, PATHS.snapshots, SNAPSHOT_ROOT_NAME,
+                         snapshot);
+}
+
+// replace snapshot of backup with a reflinked copy of it, which is near
+// instant and only takes space for what is changed afterwards.
+// skipped if the filesystem can't do reflinks, a full copy every resync
+// would cost more than the snapshot is worth
+static int snapshot_backup(const char *backup)
+{
+        struct stat sb;
+        char snapshot[PATH_MAX], tmp[PATH_MAX], parent[PATH_MAX];
+
+        get_snapshot_path(backup, snapshot);
+        snprintf(parent, PATH_MAX, "%s", snapshot);
+
+        if (create_dir(dirname(parent), 0700) == -1) {
+                return -1;
+        }
+        create_unique_path(tmp, PATH_MAX, snapshot, 0);
+
+        plog(LOG_DEBUG, "taking snapshot of %s", backup);
+
+        if (clone_path(backup, tmp, CLONE_PATH_REFLINK) == -1) {
+                int prev_errno = errno;
+
+                if (LEXISTS(tmp)) {
+                        remove_path(tmp);
+                }
+                rmdir(parent);
+                if (prev_errno == EOPNOTSUPP || prev_errno == ENOTTY ||
+                    prev_errno == EXDEV || prev_errno == EINVAL) {
+                        plog(LOG_WARN, "filesystem of %s does not support "
+                                       "reflinks, not taking snapshots",
+                             backup);
+                        return 0;
+                }
+                errno = prev_errno;
+                return -1;
+        }
+
+        if (!DIREXISTS(snapshot)) {
+                return rename(tmp, snapshot);
+        }
+        if (renameat2(AT_FDCWD, tmp, AT_FDCWD, snapshot, RENAME_EXCHANGE) ==
+                    -1 ||
+            remove_path(tmp) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+static void remove_snapshot(const char *backup)
+{
+        struct stat sb;
+        char snapshot[PATH_MAX];
+
+        get_snapshot_path(backup, snapshot);
+
+        if (DIREXISTS(snapshot) && remove_dir(snapshot) == -1) {
+                plog(LOG_WARN, "failed removing snapshot %s", snapshot);
+        }
+        // don't leave empty snapshot roots behind on other filesystems
+        if (!STR_EQUAL(dirname(snapshot), PATHS.snapshots)) {
+                rmdir(snapshot);
+        }
+}
+
+// newest mtime of what the browser wrote to dir (in the upper dir when using
+// the overlay, which is all that changed), 0 if unknown
+static time_t last_written(struct Dir *dir, bool overlay)
+{
+        char backup[PATH_MAX], tmpfs[PATH_MAX];
+
+        if (get_paths(dir, backup, tmpfs) == -1) {
+                return 0;
+        }
+#ifndef NOOVERLAY
+        if (overlay && get_overlay_paths(dir, tmpfs) == -1) {
+                return 0;
+        }
+#else
+        (void)overlay;
+#endif
+        newest_mtime = 0;
+        nftw(tmpfs, find_newest, MAX_FD, FTW_PHYS);
+
+        return newest_mtime;
+}
+
+static int find_newest(const char *UNUSED(fpath), const struct stat *sb,
+                       int typeflag, struct FTW *UNUSED(ftwbuf))
+{
+        if (typeflag != FTW_NS && sb->st_mtime > newest_mtime) {
+                newest_mtime = sb->st_mtime;
+        }
+
+        return 0;
+}
+
+static int compare_value(const void *a, const void *b)
+{
+        const struct Valued *va = a, *vb = b;
+
+        if (va->dir->type != vb->dir->type) {
+                return (va->dir->type == DIR_PROFILE) ? -1 : 1;
+        }
+
+        return (va->written < vb->written) - (va->written > vb->written);
+}
+
 // return true if directory and its parent directory is safe to handle
 // safe means if file/dir is owned by user and if owner has read + write bits
+
 static bool directory_is_safe(struct Dir *dir)
 {
         struct stat sb;
@@ -46,6 +46,7 @@ struct Dir *new_dir(const char *path, enum DirType type,
         }
         new->type = type;
         new->browser = browser;
+        new->selected = true;
 
         snprintf(new->path, PATH_MAX, "%s/%s", rlpath, bn);
         snprintf(new->dirname, NAME_MAX, "%s", bn);
@@ -91,6 +92,7 @@ void free_browser(struct Browser *browser)
                 for (size_t i = 0; i < browser->dirs_num; i++) {
                         free_dir(browser->dirs[i]);
                 }
+                free(browser->policies);
                 free(browser);
         }
 }
@@ -3,24 +3,58 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <ftw.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <glob.h>
 #include <time.h>
 #include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#include <linux/fs.h>
 
 #include <ctype.h>
+#include <signal.h>
 #include <errno.h>
 #include <sys/capability.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// largest write done at once while copies are limited
+#define THROTTLE_CHUNK (1024 * 1024)
+
+static int copy_file_flags(const char *src, const char *dest,
+                           bool reflink_only);
+static void throttle(size_t bytes);
+
+// CLOCK_MONOTONIC seconds after which copies stop, 0 if there's no deadline
+static time_t deadline = 0;
+
+// bytes and writes per second that copies are limited to, 0 if unlimited.
+// what's left to use is kept as a token bucket that fills up over a second
+static long long io_bandwidth = 0, io_ops = 0;
+static double io_bytes_left = 0, io_ops_left = 0;
+static struct timespec io_refilled = { 0 };
+
+// rsync style "+ glob" and "- glob" rules for copies of filter_root, the
+// first one that matches decides. see set_copy_filter()
+static const char *filter_root = NULL;
+static char **filter_rules = NULL;
+static size_t filter_rules_num = 0;
 
 // essentially mkdir -p
 int create_dir(const char *path, mode_t mode)
@@ -193,34 +227,172 @@ int copy_path(const char *src, const char *dest, bool include_root)
 
         // trailing clash indicates to only copy contents (only if directory)
         if (!include_root && S_ISDIR(sb.st_mode)) {
-                template = "rsync -aAX  --no-whole-file --inplace '%s/' '%s'";
+                template = "%srsync -aAX  --no-whole-file%s%s%s '%s/' '%s'";
         } else {
-                template = "rsync -aAX --no-whole-file --inplace '%s' '%s'";
+                template = "%srsync -aAX --no-whole-file%s%s%s '%s' '%s'";
         }
+        long left = deadline_left();
+        char timeout[64] = { 0 }, bwlimit[64] = { 0 };
+        char *filter = NULL;
+        size_t filter_size = 0;
+        FILE *fp = open_memstream(&filter, &filter_size);
 
-        if (asprintf(&cmdline, template, src_dup, dest) == -1) {
+        if (fp == NULL) {
                 free(src_dup);
                 return -1;
         }
+        // only when copying the root itself, anchored rules are relative to
+        // whatever is copied
+        for (size_t i = 0; filter_root != NULL && !include_root &&
+                           STR_EQUAL(src_dup, filter_root) &&
+                           i < filter_rules_num;
+             i++) {
+                fprintf(fp, " --filter='%s'", filter_rules[i]);
+        }
+        if (fclose(fp) == EOF) {
+                free(filter);
+                free(src_dup);
+                return -1;
+        }
+
+        if (left == 0) {
+                free(filter);
+                free(src_dup);
+                errno = ETIME;
+                return -1;
+        }
+        // rsync is stopped at the deadline. files are then replaced whole
+        // rather than in place, so that none are left half written
+        if (left > 0) {
+                snprintf(timeout, sizeof(timeout), "timeout %ld ", left);
+        }
+        // rsync takes KiB per second
+        if (io_bandwidth > 0) {
+                snprintf(bwlimit, sizeof(bwlimit), " --bwlimit=%lld",
+                         (io_bandwidth + 1023) / 1024);
+        }
+
+        if (asprintf(&cmdline, template, timeout,
+                     (left > 0) ? "" : " --inplace", bwlimit, filter, src_dup,
+                     dest) == -1) {
+                free(filter);
+                free(src_dup);
+                return -1;
+        }
+        free(filter);
         free(src_dup);
 
         FILE *cmdp = popen(cmdline, "r");
 
         free(cmdline);
 
-        if (cmdp == NULL || pclose(cmdp) != 0) {
+        if (cmdp == NULL) {
                 return -1;
         }
+        int status = pclose(cmdp);
 
-        return 0;
+        // timeout exits with 124 when it stopped rsync
+        if (left > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 124) {
+                errno = ETIME;
+                return -1;
+        }
+
+        return (status != 0) ? -1 : 0;
+}
+
+// copies made after seconds from now are refused, and those still going are
+// stopped
+void set_deadline(long seconds)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        deadline = ts.tv_sec + seconds;
+}
+
+// seconds left until the deadline, or -1 if there's none
+long deadline_left(void)
+{
+        struct timespec ts;
+
+        if (deadline == 0) {
+                return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (ts.tv_sec < deadline) ? (long)(deadline - ts.tv_sec) : 0;
+}
+
+// limit copies to bandwidth bytes and ops writes per second (0 for no limit).
+// rsync can only be limited in bandwidth
+void set_io_limits(long long bandwidth, long long ops)
+{
+        io_bandwidth = bandwidth;
+        io_ops = ops;
+        io_bytes_left = bandwidth;
+        io_ops_left = ops;
+        clock_gettime(CLOCK_MONOTONIC, &io_refilled);
+}
+
+// leave out what rules exclude when copying root with copy_path() or
+// clone_path(), when merging it with merge_overlay() or when getting its
+// size, NULL to copy everything again. rules are
+// "+ glob" or "- glob", where a glob without a '/' matches names anywhere,
+// else paths from root. they are kept, not copied
+void set_copy_filter(const char *root, char **rules, size_t rules_num)
+{
+        filter_root = root;
+        filter_rules = rules;
+        filter_rules_num = rules_num;
+}
+
+// true if path is under the root of the copy filter, and excluded by it
+bool copy_skips(const char *path)
+{
+        for (size_t i = 0; filter_root != NULL && i < filter_rules_num; i++) {
+                if (path_matches(filter_root, path, filter_rules[i] + 2)) {
+                        return filter_rules[i][0] == '-';
+                }
+        }
+
+        return false;
+}
+
+// true if path is under root and matched by glob, which matches names
+// anywhere if it has no '/', else paths from root if it starts with one
+bool path_matches(const char *root, const char *path, const char *glob)
+{
+        size_t len = strlen(root);
+
+        if (len == 0 || strncmp(path, root, len) != 0 || path[len] != '/') {
+                return false;
+        }
+        const char *rel = path + len + 1, *name = strrchr(path, '/') + 1;
+
+        return (glob[0] == '/') ? fnmatch(glob + 1, rel, FNM_PATHNAME) == 0 :
+                                  fnmatch(glob, name, 0) == 0;
+}
+
+// only use the CPU and disk when nothing else does, inherited by the
+// processes this one starts (like rsync)
+void set_idle_priority(void)
+{
+        struct sched_param param = { 0 };
+
+        sched_setscheduler(0, SCHED_IDLE, &param);
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
 }
 
 // handles fies/directories passed from nftw (3)
 static int remove_dir_handler(const char *fpath, const struct stat *sb,
                               int UNUSED(typeflag), struct FTW *UNUSED(ftwbuf))
 {
-        // cannot chmod a symlink
-        if (!S_ISLNK(sb->st_mode) && chmod(fpath, S_IWUSR) == -1) {
+        // cannot chmod a symlink, and hardlinked files are shared with
+        // other paths (such as generations)
+        bool shared = S_ISREG(sb->st_mode) && sb->st_nlink > 1;
+
+        if (!S_ISLNK(sb->st_mode) && !shared && chmod(fpath, S_IWUSR) == -1) {
                 return -1;
         } else if (remove(fpath) == -1) {
                 return -1;
@@ -292,6 +464,155 @@ int clear_dir(const char *path)
         return err;
 }
 
+static const char *clone_src, *clone_dest, *clone_link;
+static int clone_flags;
+
+// hardlink file to its counterpart in clone_link if it's unchanged there
+static bool link_unchanged(const char *fpath, const struct stat *sb,
+                           const char *dest)
+{
+        char prev[PATH_MAX];
+        struct stat psb;
+
+        snprintf(prev, PATH_MAX, "%s%s", clone_link,
+                 fpath + strlen(clone_src));
+
+        if (lstat(prev, &psb) == -1 || !S_ISREG(psb.st_mode) ||
+            psb.st_size != sb->st_size || psb.st_mode != sb->st_mode ||
+            psb.st_uid != sb->st_uid || psb.st_gid != sb->st_gid ||
+            psb.st_mtim.tv_sec != sb->st_mtim.tv_sec ||
+            psb.st_mtim.tv_nsec != sb->st_mtim.tv_nsec) {
+                return false;
+        }
+
+        // EMLINK and the like are handled by copying instead
+        return link(prev, dest) == 0;
+}
+
+static int clone_entry(const char *fpath, const struct stat *sb, int typeflag,
+                       struct FTW *UNUSED(ftwbuf))
+{
+        char dest[PATH_MAX];
+
+        snprintf(dest, PATH_MAX, "%s%s", clone_dest,
+                 fpath + strlen(clone_src));
+
+        if (copy_skips(fpath)) {
+                return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+        }
+        if (typeflag == FTW_D) {
+                return mkdir(dest, 0700);
+        } else if (typeflag == FTW_DNR || typeflag == FTW_NS) {
+                errno = EACCES;
+                return -1;
+        } else if (S_ISREG(sb->st_mode)) {
+                if (clone_link != NULL && link_unchanged(fpath, sb, dest)) {
+                        return 0;
+                }
+                if (copy_file_flags(fpath, dest,
+                                    clone_flags & CLONE_PATH_REFLINK) == -1) {
+                        return -1;
+                }
+        } else if (S_ISLNK(sb->st_mode)) {
+                char target[PATH_MAX] = { 0 };
+
+                if (readlink(fpath, target, PATH_MAX - 1) == -1 ||
+                    symlink(target, dest) == -1) {
+                        return -1;
+                }
+        } else if (S_ISFIFO(sb->st_mode)) {
+                if (mkfifo(dest, 0600) == -1) {
+                        return -1;
+                }
+        } else {
+                return 0; // sockets and devices don't belong in a profile
+        }
+
+        if (copy_xattrs(fpath, dest) == -1 || copy_metadata(fpath, dest) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// directories are done last, creating their entries changes their mtime
+static int clone_dir_metadata(const char *fpath, const struct stat *UNUSED(sb),
+                              int typeflag, struct FTW *UNUSED(ftwbuf))
+{
+        if (typeflag != FTW_DP) {
+                return 0;
+        }
+        char src[PATH_MAX];
+
+        snprintf(src, PATH_MAX, "%s%s", clone_src, fpath + strlen(clone_dest));
+
+        if (copy_xattrs(src, fpath) == -1 || copy_metadata(src, fpath) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// copy src to dest (which must not exist) without forking off rsync;
+// file data is reflinked where possible so that copies within one btrfs or
+// XFS filesystem are near instant and take no extra space,
+// with CLONE_PATH_REFLINK set fail instead of copying the data. what the
+// copy filter excludes is left out
+int clone_path(const char *src, const char *dest, int flags)
+{
+        if (file_has_bad_perms(src)) {
+                return -1;
+        }
+
+        clone_src = src;
+        clone_dest = dest;
+        clone_flags = flags;
+
+        int err = 0;
+
+        if (nftw(src, clone_entry, MAX_FD, FTW_PHYS | FTW_ACTIONRETVAL) ==
+                    -1 ||
+            nftw(dest, clone_dir_metadata, MAX_FD, FTW_DEPTH | FTW_PHYS) ==
+                    -1) {
+                err = -1;
+        }
+        clone_link = NULL;
+
+        return err;
+}
+
+// same as clone_path, but files that are unchanged in link_dest (same as
+// rsync's --link-dest) are hardlinked to it instead of copied
+int link_path(const char *src, const char *dest, const char *link_dest)
+{
+        clone_link = link_dest;
+
+        return clone_path(src, dest, 0);
+}
+
+static int unshare_entry(const char *fpath, const struct stat *sb,
+                         int UNUSED(typeflag), struct FTW *UNUSED(ftwbuf))
+{
+        // copy_file replaces the file, which leaves the other links alone
+        if (S_ISREG(sb->st_mode) && sb->st_nlink > 1 &&
+            copy_file(fpath, fpath) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// give every hardlinked file in path its own copy (reflinked if possible),
+// so that writing to it in place doesn't change the other links
+int unshare_links(const char *path)
+{
+        if (nftw(path, unshare_entry, MAX_FD, FTW_PHYS) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
 // move src to dest inplace via rename (2) if on same filesystem
 // else copy it to dest and remove src
 // include_root -> see copy_dir()
@@ -323,7 +644,12 @@ int move_path(const char *src, const char *dest, bool include_root)
         errno = 0;
         if (rename(src, dest_dup) == -1) {
                 if (errno == EXDEV) {
-                        if (copy_path(src, dest_dup, false) == -1) {
+                        struct stat sb;
+                        int err = LEXISTS(dest_dup) ?
+                                          copy_path(src, dest_dup, false) :
+                                          clone_path(src, dest_dup, 0);
+
+                        if (err == -1) {
                                 return -1;
                         }
                         if (remove_dir(src) == -1) {
@@ -539,22 +865,24 @@ pid_t get_pid(const char *name)
 
 static off_t dir_size = 0;
 
-static int get_dir_size_handler(const char *UNUSED(fpath),
-                                const struct stat *sb, int typeflag,
-                                struct FTW *UNUSED(ftwbuf))
+static int get_dir_size_handler(const char *fpath, const struct stat *sb,
+                                int typeflag, struct FTW *UNUSED(ftwbuf))
 {
+        if (copy_skips(fpath)) {
+                return (typeflag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+        }
         if (typeflag == FTW_F) {
                 dir_size += sb->st_size;
         }
-        return 0;
+        return FTW_CONTINUE;
 }
 
-// get dir size in bytes
+// get dir size in bytes, without what the copy filter excludes
 off_t get_dir_size(const char *path)
 {
         dir_size = 0;
 
-        if (nftw(path, get_dir_size_handler, MAX_FD, 0) == -1) {
+        if (nftw(path, get_dir_size_handler, MAX_FD, FTW_ACTIONRETVAL) == -1) {
                 return -1;
         }
 
@@ -664,4 +992,450 @@ exit:
         return err;
 }
 
+// copy size bytes of src_fd into dest_fd, sharing extents via a reflink
+// when the filesystem supports it (btrfs, XFS) and otherwise copying them
+// in kernel; if reflink_only is true then fail instead of copying
+static int copy_data(int src_fd, int dest_fd, off_t size, bool reflink_only)
+{
+        if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+                return 0;
+        }
+        if (reflink_only) {
+                return -1;
+        }
+
+        // copy_file_range (2) can still share extents or do a server side
+        // copy on NFS, fall back to sendfile (2) across filesystems
+        // it does not support
+        bool use_sendfile = false;
+        off_t offset = 0;
+
+        while (offset < size) {
+                ssize_t w = -1;
+                size_t len = size - offset;
+
+                // in small enough writes for the limits to be smooth
+                if ((io_bandwidth > 0 || io_ops > 0) && len > THROTTLE_CHUNK) {
+                        len = THROTTLE_CHUNK;
+                }
+
+                if (!use_sendfile) {
+                        w = copy_file_range(src_fd, &offset, dest_fd, NULL,
+                                            len, 0);
+                        if (w == -1 &&
+                            (errno == EXDEV || errno == EINVAL ||
+                             errno == EOPNOTSUPP || errno == ENOSYS)) {
+                                use_sendfile = true;
+                                continue;
+                        }
+                } else {
+                        w = sendfile(dest_fd, src_fd, &offset, len);
+                }
+
+                if (w == -1) {
+                        return -1;
+                }
+                if (w == 0) {
+                        break; // file shrunk while copying
+                }
+                throttle(w);
+        }
+
+        return 0;
+}
+
+// wait until there's room for a write of bytes within the limits
+static void throttle(size_t bytes)
+{
+        if (io_bandwidth <= 0 && io_ops <= 0) {
+                return;
+        }
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        double elapsed = (double)(now.tv_sec - io_refilled.tv_sec) +
+                         (double)(now.tv_nsec - io_refilled.tv_nsec) / 1e9;
+
+        io_refilled = now;
+        io_bytes_left += elapsed * (double)io_bandwidth;
+        io_ops_left += elapsed * (double)io_ops;
+
+        // at most a second's worth is saved up
+        if (io_bytes_left > (double)io_bandwidth) {
+                io_bytes_left = (double)io_bandwidth;
+        }
+        if (io_ops_left > (double)io_ops) {
+                io_ops_left = (double)io_ops;
+        }
+        io_bytes_left -= (double)bytes;
+        io_ops_left -= 1;
+
+        // until both are back to 0
+        double wait = 0, ops_wait = 0;
+
+        if (io_bandwidth > 0 && io_bytes_left < 0) {
+                wait = -io_bytes_left / (double)io_bandwidth;
+        }
+        if (io_ops > 0 && io_ops_left < 0) {
+                ops_wait = -io_ops_left / (double)io_ops;
+        }
+        if (ops_wait > wait) {
+                wait = ops_wait;
+        }
+        if (wait > 0) {
+                struct timespec ts = { .tv_sec = (time_t)wait,
+                                       .tv_nsec = (long)((wait - (time_t)wait) *
+                                                         1e9) };
+
+                nanosleep(&ts, NULL);
+        }
+}
+
+// see copy_file()
+static int copy_file_flags(const char *src, const char *dest,
+                           bool reflink_only)
+{
+        int err = 0;
+        int src_fd = open(src, O_RDONLY), dest_fd = -1;
+        char tmp_path[PATH_MAX];
+        char *tmp = strdup(dest);
+
+        if (src_fd == -1 || tmp == NULL) {
+                err = -1;
+                goto exit;
+        }
+        snprintf(tmp_path, PATH_MAX, "%s/.bor-tmp-XXXXXX", dirname(tmp));
+
+        if ((dest_fd = mkstemp(tmp_path)) == -1) {
+                err = -1;
+                goto exit;
+        }
+        struct stat sb;
+
+        if (fstat(src_fd, &sb) == -1) {
+                err = -1;
+                goto exit;
+        }
+
+        if (copy_data(src_fd, dest_fd, sb.st_size, reflink_only) == -1) {
+                err = -1;
+                goto exit;
+        }
+
+        struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+
+        // owner can only be preserved if we are allowed to
+        if (fchown(dest_fd, sb.st_uid, sb.st_gid) == -1 && errno != EPERM) {
+                err = -1;
+                goto exit;
+        }
+        if (fchmod(dest_fd, sb.st_mode & 07777) == -1 ||
+            futimens(dest_fd, times) == -1) {
+                err = -1;
+                goto exit;
+        }
+        if (rename(tmp_path, dest) == -1) {
+                err = -1;
+                goto exit;
+        }
+
+exit:
+        if (src_fd != -1) {
+                close(src_fd);
+        }
+        if (dest_fd != -1) {
+                close(dest_fd);
+                if (err == -1) {
+                        int prev_errno = errno;
+                        unlink(tmp_path);
+                        errno = prev_errno;
+                }
+        }
+        free(tmp);
+
+        return err;
+}
+
+// copy a regular file along with its mode, owner and timestamps;
+// dest is replaced atomically so that it is never left half written
+int copy_file(const char *src, const char *dest)
+{
+        return copy_file_flags(src, dest, false);
+}
+
+// copy xattrs (and thus ACLs) of src onto dest (does not follow symlinks),
+// best effort like for ownership
+int copy_xattrs(const char *src, const char *dest)
+{
+        ssize_t len = llistxattr(src, NULL, 0);
+
+        if (len <= 0) {
+                return (len == -1 && errno != ENOTSUP) ? -1 : 0;
+        }
+        char *names = malloc(len);
+
+        if (names == NULL) {
+                return -1;
+        }
+        len = llistxattr(src, names, len);
+
+        for (ssize_t i = 0; i < len; i += (ssize_t)strlen(names + i) + 1) {
+                char value[XATTR_SIZE_MAX];
+                ssize_t vlen = lgetxattr(src, names + i, value, sizeof(value));
+
+                if (vlen >= 0) {
+                        lsetxattr(dest, names + i, value, vlen, 0);
+                }
+        }
+        free(names);
+
+        return 0;
+}
+
+// copy mode, owner and timestamps of src onto dest (does not follow symlinks)
+int copy_metadata(const char *src, const char *dest)
+{
+        struct stat sb, dsb;
+
+        if (lstat(src, &sb) == -1 || lstat(dest, &dsb) == -1) {
+                return -1;
+        }
+        struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+
+        // only change what differs, dest may be on an overlay where
+        // any change copies it up
+        if ((sb.st_uid != dsb.st_uid || sb.st_gid != dsb.st_gid) &&
+            lchown(dest, sb.st_uid, sb.st_gid) == -1 && errno != EPERM) {
+                return -1;
+        }
+        if (!S_ISLNK(sb.st_mode) &&
+            (sb.st_mode & 07777) != (dsb.st_mode & 07777) &&
+            chmod(dest, sb.st_mode & 07777) == -1) {
+                return -1;
+        }
+        if ((sb.st_mtim.tv_sec != dsb.st_mtim.tv_sec ||
+             sb.st_mtim.tv_nsec != dsb.st_mtim.tv_nsec) &&
+            utimensat(AT_FDCWD, dest, times, AT_SYMLINK_NOFOLLOW) == -1) {
+                return -1;
+        }
+
+        return 0;
+}
+
+// compare contents of two regular files
+bool files_identical(const char *path1, const char *path2)
+{
+        struct stat sb1, sb2;
+
+        if (stat(path1, &sb1) == -1 || stat(path2, &sb2) == -1 ||
+            sb1.st_size != sb2.st_size) {
+                return false;
+        }
+        FILE *fp1 = fopen(path1, "r"), *fp2 = fopen(path2, "r");
+        bool same = (fp1 != NULL && fp2 != NULL);
+        char buf1[BUFSIZ], buf2[BUFSIZ];
+
+        while (same) {
+                size_t r1 = fread(buf1, 1, BUFSIZ, fp1),
+                       r2 = fread(buf2, 1, BUFSIZ, fp2);
+
+                if (r1 != r2 || memcmp(buf1, buf2, r1) != 0) {
+                        same = false;
+                }
+                if (r1 == 0) {
+                        break;
+                }
+        }
+        if (fp1 != NULL) {
+                fclose(fp1);
+        }
+        if (fp2 != NULL) {
+                fclose(fp2);
+        }
+
+        return same;
+}
+
+// write out everything cached for the filesystem path is on. that's a lot
+// cheaper than fsyncing every file that was written to it
+int sync_filesystem(const char *path)
+{
+        int fd = open(path, O_RDONLY | O_DIRECTORY);
+
+        if (fd == -1) {
+                return -1;
+        }
+        int err = syncfs(fd);
+
+        close(fd);
+
+        return err;
+}
+
+// return malloc'd array of malloc'd paths of files opened by
+// processes of the current user, with length len
+char **get_open_files(size_t *len)
+{
+        DIR *dp = opendir("/proc");
+        struct dirent *ent;
+        size_t size = 64;
+        char **files = malloc(size * sizeof(*files));
+
+        *len = 0;
+        if (dp == NULL || files == NULL) {
+                if (dp != NULL) {
+                        closedir(dp);
+                }
+                free(files);
+                return NULL;
+        }
+        char fdpath[PATH_MAX], linkpath[PATH_MAX];
+
+        while ((ent = readdir(dp)) != NULL) {
+                long lpid = atol(ent->d_name);
+
+                if (lpid <= 0) {
+                        continue;
+                }
+                snprintf(fdpath, PATH_MAX, "/proc/%ld/fd", lpid);
+
+                // can only read fds of our own processes anyways
+                DIR *fdp = opendir(fdpath);
+                struct dirent *fent;
+
+                if (fdp == NULL) {
+                        continue;
+                }
+                while ((fent = readdir(fdp)) != NULL) {
+                        if (name_is_dot(fent->d_name)) {
+                                continue;
+                        }
+                        snprintf(fdpath, PATH_MAX, "/proc/%ld/fd/%s", lpid,
+                                 fent->d_name);
+
+                        ssize_t r = readlink(fdpath, linkpath, PATH_MAX - 1);
+
+                        if (r <= 0 || linkpath[0] != '/') {
+                                continue;
+                        }
+                        linkpath[r] = 0;
+
+                        if (*len == size) {
+                                size *= 2;
+                                char **tmp =
+                                        realloc(files, size * sizeof(*files));
+
+                                if (tmp == NULL) {
+                                        break;
+                                }
+                                files = tmp;
+                        }
+                        if ((files[*len] = strdup(linkpath)) != NULL) {
+                                (*len)++;
+                        }
+                }
+                closedir(fdp);
+        }
+        closedir(dp);
+
+        return files;
+}
+
+// check if any of our processes has a file open on filesystem dev
+bool files_open_on(dev_t dev)
+{
+        DIR *dp = opendir("/proc");
+        struct dirent *ent;
+        bool found = false;
+
+        if (dp == NULL) {
+                // assume the worst
+                return true;
+        }
+        char fdpath[PATH_MAX];
+
+        while (!found && (ent = readdir(dp)) != NULL) {
+                long lpid = atol(ent->d_name);
+
+                if (lpid <= 0) {
+                        continue;
+                }
+                snprintf(fdpath, PATH_MAX, "/proc/%ld/fd", lpid);
+
+                DIR *fdp = opendir(fdpath);
+                struct dirent *fent;
+
+                if (fdp == NULL) {
+                        continue;
+                }
+                while (!found && (fent = readdir(fdp)) != NULL) {
+                        struct stat sb;
+
+                        if (name_is_dot(fent->d_name)) {
+                                continue;
+                        }
+                        snprintf(fdpath, PATH_MAX, "/proc/%ld/fd/%s", lpid,
+                                 fent->d_name);
+
+                        found = (stat(fdpath, &sb) == 0 && sb.st_dev == dev);
+                }
+                closedir(fdp);
+        }
+        closedir(dp);
+
+        return found;
+}
+
+int write_file(const char *path, const char *str)
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd == -1) {
+                return -1;
+        }
+        ssize_t len = (ssize_t)strlen(str);
+
+        if (write(fd, str, len) != len) {
+                close(fd);
+                return -1;
+        }
+
+        return close(fd);
+}
+
+// return pid stored in file if it's a running instance of this program,
+// else -1 (file doesn't exist, process exited or pid was reused)
+pid_t read_pid_file(const char *path)
+{
+        FILE *fp = fopen(path, "r");
+
+        if (fp == NULL) {
+                return -1;
+        }
+        long int lpid = -1;
+
+        if (fscanf(fp, "%ld", &lpid) != 1 || lpid <= 0) {
+                lpid = -1;
+        }
+        fclose(fp);
+
+        if (lpid == -1 || kill((pid_t)lpid, 0) == -1) {
+                return -1;
+        }
+
+        // check if pid was reused by something else
+        char exepath[PATH_MAX], rlpath[PATH_MAX], selfpath[PATH_MAX];
+
+        snprintf(exepath, PATH_MAX, "/proc/%ld/exe", lpid);
+
+        if (realpath(exepath, rlpath) == NULL ||
+            realpath("/proc/self/exe", selfpath) == NULL ||
+            !STR_EQUAL(rlpath, selfpath)) {
+                return -1;
+        }
+
+        return (pid_t)lpid;
+}
+
 // vim: sw=8 ts=8